@@ -2,4 +2,7 @@ require 'mkmf'
 
 $defs.push("-DBUILD_FOR_RUBY")
 have_library('pcre', 'pcre_compile')
+have_header('pthread.h')
+have_header('sys/mman.h')
+have_func('rb_ext_ractor_safe', 'ruby.h')
 create_makefile("version_sorter")
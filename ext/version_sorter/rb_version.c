@@ -0,0 +1,236 @@
+/*
+ *  rb_version.c
+ *  version_sorter
+ *
+ *  VersionSorter::Version, a version parsed once into its binary key so
+ *  that comparing, hashing and sorting it never parses it again.
+ *
+ */
+
+#if XCODE
+#include <Ruby/ruby.h>
+#else
+#include <ruby.h>
+#endif
+#include "version_sorter.h"
+
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
+
+typedef struct _RubyVersion {
+    VALUE str;
+    size_t key_len;
+    unsigned char key[1];
+} RubyVersion;
+
+static VALUE rb_cVersion;
+static ID id_freeze;
+
+static VALUE rb_version_s_new(VALUE, VALUE);
+static VALUE rb_version_to_s(VALUE);
+static VALUE rb_version_inspect(VALUE);
+static VALUE rb_version_cmp(VALUE, VALUE);
+static VALUE rb_version_eql_p(VALUE, VALUE);
+static VALUE rb_version_hash(VALUE);
+static VALUE rb_version_dup(VALUE);
+static VALUE rb_version_clone(int, VALUE *, VALUE);
+static VALUE rb_version_dump(int, VALUE *, VALUE);
+static VALUE rb_version_s_load(VALUE, VALUE);
+
+
+static void
+version_mark(void *ptr)
+{
+    if (ptr != NULL) {
+        rb_gc_mark(((RubyVersion *)ptr)->str);
+    }
+}
+
+static size_t
+version_memsize(const void *ptr)
+{
+    return ptr != NULL ? sizeof(RubyVersion) + ((const RubyVersion *)ptr)->key_len : 0;
+}
+
+static const rb_data_type_t version_type = {
+    "VersionSorter::Version",
+    { version_mark, RUBY_TYPED_DEFAULT_FREE, version_memsize, },
+    0, 0,
+    RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static RubyVersion *
+get_version(VALUE self)
+{
+    RubyVersion *v;
+    TypedData_Get_Struct(self, RubyVersion, &version_type, v);
+    return v;
+}
+
+/*
+ * If `obj` is a VersionSorter::Version, point `key` and `key_len` at its
+ * key and return 1; return 0 for anything else.
+ */
+int
+rb_version_sorter_version_key(VALUE obj, const unsigned char **key, size_t *key_len)
+{
+    RubyVersion *v;
+
+    if (!rb_typeddata_is_kind_of(obj, &version_type)) {
+        return 0;
+    }
+    v = DATA_PTR(obj);
+    *key = v->key;
+    *key_len = v->key_len;
+    return 1;
+}
+
+/*
+ * VersionSorter::Version.new(str)
+ *
+ * Parses `str` once. The version keeps a frozen copy of it and is frozen
+ * itself, so it can be shared freely, even between Ractors.
+ */
+VALUE
+rb_version_s_new(VALUE klass, VALUE str)
+{
+    RubyVersion *v;
+    size_t key_max;
+    VALUE self;
+
+    if (rb_typeddata_is_kind_of(str, &version_type)) {
+        return str;
+    }
+    StringValue(str);
+    str = rb_str_new_frozen(str);
+    key_max = VERSION_SORTER_KEY_MAX(RSTRING_LEN(str));
+
+    self = TypedData_Wrap_Struct(klass, &version_type, NULL);
+    v = ruby_xmalloc(sizeof(RubyVersion) + key_max);
+    v->str = str;
+    v->key_len = version_sorter_key(RSTRING_PTR(str), RSTRING_LEN(str), v->key, key_max);
+    DATA_PTR(self) = v;
+
+    return rb_obj_freeze(self);
+}
+
+VALUE
+rb_version_to_s(VALUE self)
+{
+    return get_version(self)->str;
+}
+
+VALUE
+rb_version_inspect(VALUE self)
+{
+    return rb_sprintf("#<%"PRIsVALUE" %+"PRIsVALUE">", rb_obj_class(self), get_version(self)->str);
+}
+
+/* Compares with another Version or with a version String */
+VALUE
+rb_version_cmp(VALUE self, VALUE other)
+{
+    RubyVersion *v = get_version(self);
+    const unsigned char *other_key;
+    unsigned char *key;
+    size_t key_len;
+    VALUE v_key;
+    int cmp;
+
+    if (rb_version_sorter_version_key(other, &other_key, &key_len)) {
+        cmp = version_sorter_key_compare(v->key, v->key_len, other_key, key_len);
+    } else if (RB_TYPE_P(other, T_STRING)) {
+        key = ALLOCV(v_key, VERSION_SORTER_KEY_MAX(RSTRING_LEN(other)) + 1);
+        key_len = version_sorter_key(RSTRING_PTR(other), RSTRING_LEN(other), key, VERSION_SORTER_KEY_MAX(RSTRING_LEN(other)));
+        cmp = version_sorter_key_compare(v->key, v->key_len, key, key_len);
+        ALLOCV_END(v_key);
+    } else {
+        return Qnil;
+    }
+    return INT2FIX(cmp < 0 ? -1 : (cmp > 0 ? 1 : 0));
+}
+
+/*
+ * Two versions are eql? when they sort together, which is also when their
+ * hashes match: "1.0" and "1-0" are the same version.
+ */
+VALUE
+rb_version_eql_p(VALUE self, VALUE other)
+{
+    RubyVersion *v = get_version(self);
+    const unsigned char *other_key;
+    size_t key_len;
+
+    if (!rb_version_sorter_version_key(other, &other_key, &key_len)) {
+        return Qfalse;
+    }
+    return version_sorter_key_compare(v->key, v->key_len, other_key, key_len) == 0 ? Qtrue : Qfalse;
+}
+
+VALUE
+rb_version_hash(VALUE self)
+{
+    RubyVersion *v = get_version(self);
+    return ST2FIX(rb_memhash(v->key, v->key_len));
+}
+
+/*
+ * A Version is frozen and never changes, so like an Integer it is its own
+ * copy. There is no allocator to copy it with anyway.
+ */
+VALUE
+rb_version_dup(VALUE self)
+{
+    return self;
+}
+
+VALUE
+rb_version_clone(int argc, VALUE *argv, VALUE self)
+{
+    VALUE opts, freeze = Qundef;
+
+    rb_scan_args(argc, argv, "0:", &opts);
+    if (!NIL_P(opts)) {
+        rb_get_kwargs(opts, &id_freeze, 0, 1, &freeze);
+    }
+    if (freeze == Qfalse) {
+        rb_raise(rb_eArgError, "can't unfreeze %"PRIsVALUE, rb_obj_class(self));
+    }
+    return self;
+}
+
+/* Marshals as its String; the key is rebuilt on load */
+VALUE
+rb_version_dump(int argc, VALUE *argv, VALUE self)
+{
+    rb_check_arity(argc, 0, 1);
+    return get_version(self)->str;
+}
+
+VALUE
+rb_version_s_load(VALUE klass, VALUE str)
+{
+    return rb_version_s_new(klass, str);
+}
+
+void
+Init_version(VALUE module)
+{
+    id_freeze = rb_intern("freeze");
+
+    rb_cVersion = rb_define_class_under(module, "Version", rb_cObject);
+    rb_include_module(rb_cVersion, rb_mComparable);
+    rb_undef_alloc_func(rb_cVersion);
+
+    rb_define_singleton_method(rb_cVersion, "new", rb_version_s_new, 1);
+    rb_define_method(rb_cVersion, "to_s", rb_version_to_s, 0);
+    rb_define_method(rb_cVersion, "inspect", rb_version_inspect, 0);
+    rb_define_method(rb_cVersion, "<=>", rb_version_cmp, 1);
+    rb_define_method(rb_cVersion, "eql?", rb_version_eql_p, 1);
+    rb_define_method(rb_cVersion, "hash", rb_version_hash, 0);
+    rb_define_method(rb_cVersion, "dup", rb_version_dup, 0);
+    rb_define_method(rb_cVersion, "clone", rb_version_clone, -1);
+    rb_define_method(rb_cVersion, "_dump", rb_version_dump, -1);
+    rb_define_singleton_method(rb_cVersion, "_load", rb_version_s_load, 1);
+}
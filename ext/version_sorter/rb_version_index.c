@@ -0,0 +1,423 @@
+/*
+ *  rb_version_index.c
+ *  version_sorter
+ *
+ *  VersionSorter::Index, the Ruby side of version_index.c.
+ *
+ */
+
+#if XCODE
+#include <Ruby/ruby.h>
+#else
+#include <ruby.h>
+#endif
+#include <ruby/encoding.h>
+#include <ruby/thread.h>
+#include <errno.h>
+#include <string.h>
+#include "version_sorter.h"
+#include "version_index.h"
+
+#if HAVE_VERSION_INDEX
+
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
+
+static VALUE rb_cIndex;
+static VALUE rb_eFormatError;
+static ID id_verify;
+
+static VALUE rb_index_build(VALUE, VALUE, VALUE);
+static VALUE rb_index_append(VALUE, VALUE, VALUE);
+static VALUE rb_index_alloc(VALUE);
+static VALUE rb_index_initialize(int, VALUE *, VALUE);
+static VALUE rb_index_verify(VALUE);
+static VALUE rb_index_size(VALUE);
+static VALUE rb_index_aref(VALUE, VALUE);
+static VALUE rb_index_each(VALUE);
+static VALUE rb_index_rank(VALUE, VALUE);
+static VALUE rb_index_include_p(VALUE, VALUE);
+static VALUE rb_index_range(VALUE, VALUE, VALUE);
+static VALUE rb_index_latest(int, VALUE *, VALUE);
+static VALUE rb_index_close(VALUE);
+
+
+static void
+index_free(void *ptr)
+{
+    version_index_close((VersionIndex *)ptr);
+    xfree(ptr);
+}
+
+static size_t
+index_memsize(const void *ptr)
+{
+    /* The mapping is shared page cache, not heap */
+    return sizeof(VersionIndex);
+}
+
+static const rb_data_type_t index_type = {
+    "VersionSorter::Index",
+    { NULL, index_free, index_memsize, },
+    0, 0,
+    RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static void
+check_status(int status, VALUE path)
+{
+    switch (status) {
+    case VERSION_INDEX_OK:
+        return;
+    case VERSION_INDEX_CORRUPT:
+        rb_raise(rb_eFormatError, "%"PRIsVALUE" is not a valid version index", path);
+    case VERSION_INDEX_TOO_BIG:
+        rb_raise(rb_eRangeError, "too many versions for one index");
+    default:
+        rb_sys_fail_str(path);
+    }
+}
+
+static VersionIndex *
+get_index(VALUE self)
+{
+    VersionIndex *idx;
+    TypedData_Get_Struct(self, VersionIndex, &index_type, idx);
+    if (idx->map == NULL) {
+        rb_raise(rb_eIOError, "closed version index");
+    }
+    return idx;
+}
+
+/* Entries come back as UTF-8, which is what version strings are written in */
+static VALUE
+entry_str(const VersionIndex *idx, size_t i)
+{
+    size_t len;
+    const char *str = version_index_get(idx, i, &len);
+    if (str == NULL) {
+        rb_raise(rb_eFormatError, "damaged version index entry %"PRIuSIZE, i);
+    }
+    return rb_utf8_str_new(str, len);
+}
+
+typedef struct _WriteCall {
+    int (*write)(const char *, char **, size_t);
+    const char *path;
+    char **list;
+    size_t len;
+    int lock;
+    int status;
+} WriteCall;
+
+static void *
+write_without_gvl(void *arg)
+{
+    WriteCall *call = arg;
+    call->status = call->write(call->path, call->list, call->len);
+    return NULL;
+}
+
+static VALUE
+write_call(VALUE arg)
+{
+    rb_thread_call_without_gvl(write_without_gvl, (void *)arg, RUBY_UBF_IO, NULL);
+    return Qnil;
+}
+
+static VALUE
+unlock_call(VALUE arg)
+{
+    version_index_unlock(((WriteCall *)arg)->lock);
+    return Qnil;
+}
+
+/*
+ * Wait for the lock of the index at `path` without blocking the other
+ * threads, polling with a growing delay. The wait can be interrupted
+ * like a sleep.
+ */
+static int
+lock_index(VALUE path)
+{
+    struct timeval delay;
+    int lock;
+
+    delay.tv_sec = 0;
+    delay.tv_usec = 1000;
+    while ((lock = version_index_lock(RSTRING_PTR(path), 0)) < 0) {
+        if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+            rb_sys_fail_str(path);
+        }
+        rb_thread_wait_for(delay);
+        if (delay.tv_usec < 64000) {
+            delay.tv_usec *= 2;
+        }
+    }
+    return lock;
+}
+
+/*
+ * Converting an entry runs its to_str, which may allocate, so every
+ * converted String is kept in a hidden Array until all are converted;
+ * frozen copies, so that a later to_str cannot change what was checked.
+ * They are then copied into one buffer the write can read without the
+ * GVL, and so without the GC moving them.
+ */
+static VALUE
+write_list(int (*write)(const char *, char **, size_t), VALUE path, VALUE list)
+{
+    long len, i;
+    size_t size = 1;
+    char *buf;
+    WriteCall call;
+    VALUE rb_str, strs, v_list, v_buf;
+
+    FilePathValue(path);
+    path = rb_str_new_frozen(path);
+    StringValueCStr(path);
+    Check_Type(list, T_ARRAY);
+    len = RARRAY_LEN(list);
+    strs = rb_ary_tmp_new(len);
+    for (i = 0; i < len; i++) {
+        rb_str = rb_ary_entry(list, i);
+        StringValueCStr(rb_str);
+        rb_ary_push(strs, rb_str_new_frozen(rb_str));
+        size += RSTRING_LEN(rb_str) + 1;
+    }
+
+    call.list = ALLOCV_N(char *, v_list, len);
+    buf = ALLOCV(v_buf, size);
+    for (i = 0; i < len; i++) {
+        rb_str = RARRAY_AREF(strs, i);
+        call.list[i] = buf;
+        memcpy(buf, RSTRING_PTR(rb_str), RSTRING_LEN(rb_str));
+        buf += RSTRING_LEN(rb_str);
+        *buf++ = '\0';
+    }
+    call.write = write;
+    call.path = RSTRING_PTR(path);
+    call.len = len;
+    call.lock = lock_index(path);
+    rb_ensure(write_call, (VALUE)&call, unlock_call, (VALUE)&call);
+
+    RB_GC_GUARD(strs);
+    RB_GC_GUARD(path);
+    ALLOCV_END(v_buf);
+    ALLOCV_END(v_list);
+    check_status(call.status, path);
+    return Qnil;
+}
+
+/*
+ * VersionSorter::Index.build(path, versions)
+ *
+ * Writes a new index of `versions` to `path`, replacing any index there.
+ */
+VALUE
+rb_index_build(VALUE klass, VALUE path, VALUE list)
+{
+    return write_list(version_index_build_locked, path, list);
+}
+
+/*
+ * VersionSorter::Index.append(path, versions)
+ *
+ * Merges `versions` into the index at `path`, creating it if needed. Open
+ * indexes keep seeing the old contents until they are reopened.
+ */
+VALUE
+rb_index_append(VALUE klass, VALUE path, VALUE list)
+{
+    return write_list(version_index_append_locked, path, list);
+}
+
+VALUE
+rb_index_alloc(VALUE klass)
+{
+    VersionIndex *idx;
+    return TypedData_Make_Struct(klass, VersionIndex, &index_type, idx);
+}
+
+/*
+ * VersionSorter::Index.new(path, verify: false)
+ *
+ * Maps the index at `path`, checking only its header so that opening
+ * costs the same whatever its size. With `verify` the whole file is
+ * checked as well, as by #verify.
+ */
+VALUE
+rb_index_initialize(int argc, VALUE *argv, VALUE self)
+{
+    VersionIndex *idx;
+    VALUE path, opts, verify = Qundef;
+    TypedData_Get_Struct(self, VersionIndex, &index_type, idx);
+
+    rb_scan_args(argc, argv, "1:", &path, &opts);
+    if (!NIL_P(opts)) {
+        rb_get_kwargs(opts, &id_verify, 0, 1, &verify);
+    }
+    rb_check_frozen(self);
+    FilePathValue(path);
+    version_index_close(idx);
+    check_status(version_index_open(idx, StringValueCStr(path)), path);
+    if (verify != Qundef && RTEST(verify)) {
+        rb_index_verify(self);
+    }
+    return self;
+}
+
+/*
+ * Reads the whole index to check its checksum and entries, raising
+ * FormatError if it is damaged. Without it a damaged index may give wrong
+ * answers, though never read outside the file.
+ */
+VALUE
+rb_index_verify(VALUE self)
+{
+    if (version_index_verify(get_index(self)) != VERSION_INDEX_OK) {
+        rb_raise(rb_eFormatError, "damaged version index");
+    }
+    return self;
+}
+
+VALUE
+rb_index_size(VALUE self)
+{
+    return ULL2NUM(get_index(self)->count);
+}
+
+VALUE
+rb_index_aref(VALUE self, VALUE pos)
+{
+    VersionIndex *idx = get_index(self);
+    long i = NUM2LONG(pos);
+
+    if (i < 0) {
+        i += (long)idx->count;
+    }
+    if (i < 0 || (uint64_t)i >= idx->count) {
+        return Qnil;
+    }
+    return entry_str(idx, i);
+}
+
+VALUE
+rb_index_each(VALUE self)
+{
+    uint64_t i;
+
+    RETURN_SIZED_ENUMERATOR(self, 0, 0, rb_index_size);
+    for (i = 0; i < get_index(self)->count; i++) {
+        rb_yield(entry_str(get_index(self), i));
+    }
+    return self;
+}
+
+/* Number of indexed versions that sort before `version` */
+VALUE
+rb_index_rank(VALUE self, VALUE version)
+{
+    StringValue(version);
+    return SIZET2NUM(version_index_lower_bound(get_index(self), RSTRING_PTR(version), RSTRING_LEN(version)));
+}
+
+VALUE
+rb_index_include_p(VALUE self, VALUE version)
+{
+    StringValue(version);
+    return version_index_find(get_index(self), RSTRING_PTR(version), RSTRING_LEN(version), NULL) ? Qtrue : Qfalse;
+}
+
+/* All indexed versions from `from` up to and including `to`, in order */
+VALUE
+rb_index_range(VALUE self, VALUE from, VALUE to)
+{
+    VersionIndex *idx = get_index(self);
+    size_t lo, hi, i;
+    VALUE dest;
+
+    StringValue(from);
+    StringValue(to);
+    lo = version_index_lower_bound(idx, RSTRING_PTR(from), RSTRING_LEN(from));
+    hi = version_index_upper_bound(idx, RSTRING_PTR(to), RSTRING_LEN(to));
+
+    dest = rb_ary_new2(hi > lo ? hi - lo : 0);
+    for (i = lo; i < hi; i++) {
+        rb_ary_push(dest, entry_str(idx, i));
+    }
+    return dest;
+}
+
+/* The `n` newest versions, newest first */
+VALUE
+rb_index_latest(int argc, VALUE *argv, VALUE self)
+{
+    VersionIndex *idx = get_index(self);
+    VALUE n, dest;
+    long count = 1, i;
+
+    if (rb_scan_args(argc, argv, "01", &n) == 1) {
+        count = NUM2LONG(n);
+        if (count < 0) {
+            rb_raise(rb_eArgError, "negative count");
+        }
+    }
+    if ((uint64_t)count > idx->count) {
+        count = (long)idx->count;
+    }
+
+    dest = rb_ary_new2(count);
+    for (i = 0; i < count; i++) {
+        rb_ary_push(dest, entry_str(idx, idx->count - 1 - i));
+    }
+    return dest;
+}
+
+/*
+ * Unmaps the index. A frozen index can be shared between Ractors, so it
+ * stays mapped until it is garbage collected.
+ */
+VALUE
+rb_index_close(VALUE self)
+{
+    VersionIndex *idx;
+    TypedData_Get_Struct(self, VersionIndex, &index_type, idx);
+    rb_check_frozen(self);
+    version_index_close(idx);
+    return Qnil;
+}
+
+void
+Init_version_index(VALUE module)
+{
+    id_verify = rb_intern("verify");
+
+    rb_cIndex = rb_define_class_under(module, "Index", rb_cObject);
+    rb_eFormatError = rb_define_class_under(rb_cIndex, "FormatError", rb_eStandardError);
+    rb_include_module(rb_cIndex, rb_mEnumerable);
+
+    rb_define_singleton_method(rb_cIndex, "build", rb_index_build, 2);
+    rb_define_singleton_method(rb_cIndex, "append", rb_index_append, 2);
+    rb_define_alloc_func(rb_cIndex, rb_index_alloc);
+    rb_define_method(rb_cIndex, "initialize", rb_index_initialize, -1);
+    rb_define_method(rb_cIndex, "verify", rb_index_verify, 0);
+    rb_define_method(rb_cIndex, "size", rb_index_size, 0);
+    rb_define_method(rb_cIndex, "[]", rb_index_aref, 1);
+    rb_define_method(rb_cIndex, "each", rb_index_each, 0);
+    rb_define_method(rb_cIndex, "rank", rb_index_rank, 1);
+    rb_define_method(rb_cIndex, "include?", rb_index_include_p, 1);
+    rb_define_method(rb_cIndex, "range", rb_index_range, 2);
+    rb_define_method(rb_cIndex, "latest", rb_index_latest, -1);
+    rb_define_method(rb_cIndex, "close", rb_index_close, 0);
+}
+
+#else
+
+void
+Init_version_index(VALUE module)
+{
+}
+
+#endif /* HAVE_VERSION_INDEX */
@@ -12,38 +12,437 @@
 #else
 #include <ruby.h>
 #endif
+#include <ruby/encoding.h>
+#include <ruby/thread.h>
 #include "version_sorter.h"
 
 static VALUE rb_version_sorter_module;
+static VALUE rb_cSorter;
+static ID id_threads;
+static ID id_depth;
+static ID id_reverse;
 
 static VALUE rb_sort(VALUE, VALUE);
 static VALUE rb_rsort(VALUE, VALUE);
+static VALUE rb_sort_many(int, VALUE *, VALUE);
+static VALUE rb_sort_key(VALUE, VALUE);
+static VALUE rb_latest_per_line(int, VALUE *, VALUE);
+static VALUE rb_sort_lines(int, VALUE *, VALUE);
+static VALUE rb_sorter_alloc(VALUE);
+static VALUE rb_sorter_sort(VALUE, VALUE);
+static VALUE rb_sorter_rsort(VALUE, VALUE);
+static VALUE rb_sorter_sort_many(VALUE, VALUE);
+static VALUE rb_sorter_latest_per_line(int, VALUE *, VALUE);
+static VALUE rb_sorter_sort_lines(int, VALUE *, VALUE);
+static VALUE rb_sorter_shrink(VALUE);
 
+extern void Init_version(VALUE);
+extern void Init_version_index(VALUE);
+extern int rb_version_sorter_version_key(VALUE, const unsigned char **, size_t *);
 
-VALUE
-rb_sort(VALUE obj, VALUE list)
+
+static void
+sorter_free(void *ptr)
+{
+    version_sorter_context_free((VersionSorterContext *)ptr);
+}
+
+static size_t
+sorter_memsize(const void *ptr)
+{
+    const VersionSorterContext *ctx = ptr;
+    const VersionArenaBlock *block;
+    size_t size = sizeof(VersionSorterContext) +
+        ctx->items_capa * (sizeof(VersionSortingItem) + sizeof(VersionSortingItem *) + sizeof(int) + sizeof(char *));
+
+    for (block = ctx->arena; block != NULL; block = block->next) {
+        size += sizeof(VersionArenaBlock) + block->capa;
+    }
+    return size;
+}
+
+static const rb_data_type_t sorter_type = {
+    "VersionSorter::Sorter",
+    { NULL, sorter_free, sorter_memsize, },
+    0, 0,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+typedef struct _SortCall {
+    VersionSorterContext *ctx;
+    VALUE entries;
+    long len;
+    long depth;
+} SortCall;
+
+/*
+ * Snapshot `list` before anything touches a context: a hidden Array with
+ * the `len` entries of `list` followed by what gets sorted for each one,
+ * the entry itself if it is a Version or else the String its to_str
+ * returned. Converting runs arbitrary Ruby code, which must never find a
+ * context half-filled, and the Array keeps every key and String the
+ * context points into alive until the sort is over.
+ */
+static VALUE
+resolve_list(VALUE list)
+{
+    long len, i;
+    const unsigned char *key;
+    size_t key_len;
+    VALUE entries, entry;
+
+    Check_Type(list, T_ARRAY);
+    len = RARRAY_LEN(list);
+    entries = rb_ary_tmp_new(len * 2);
+    for (i = 0; i < len; i++) {
+        rb_ary_push(entries, rb_ary_entry(list, i));
+    }
+    for (i = 0; i < len; i++) {
+        entry = RARRAY_AREF(entries, i);
+        if (!rb_version_sorter_version_key(entry, &key, &key_len)) {
+            StringValue(entry);
+        }
+        rb_ary_push(entries, entry);
+    }
+    return entries;
+}
+
+/* Begin a sort on `ctx` and add the `len` resolved entries to it */
+static void
+add_entries(VersionSorterContext *ctx, VALUE entries, long len)
 {
-    long len = RARRAY_LEN(list);
     long i;
-    char **c_list = calloc(len, sizeof(char *));
-    int *ordering;
-    VALUE rb_str, dest;
+    const unsigned char *key;
+    size_t key_len;
+    VALUE entry;
 
+    if (version_sorter_context_begin(ctx, len) < 0) {
+        DIE("ERROR: Not enough memory to sort versions")
+    }
     for (i = 0; i < len; i++) {
-        rb_str = rb_ary_entry(list, i);
-        c_list[i] = StringValuePtr(rb_str);
+        entry = RARRAY_AREF(entries, len + i);
+        if (rb_version_sorter_version_key(entry, &key, &key_len)) {
+            version_sorter_context_add_key(ctx, i, key, key_len);
+        } else if (version_sorter_context_add(ctx, i, RSTRING_PTR(entry), RSTRING_LEN(entry)) < 0) {
+            DIE("ERROR: Not enough memory to sort versions")
+        }
     }
-    ordering = version_sorter_sort(c_list, len);
+}
+
+/* The `len` entries picked by `ordering`, in that order */
+static VALUE
+ordered_entries(VALUE entries, const int *ordering, long len)
+{
+    long i;
+    VALUE dest = rb_ary_new2(len);
 
-    dest = rb_ary_new2(len);
     for (i = 0; i < len; i++) {
-        rb_ary_store(dest, i, rb_ary_entry(list, ordering[i]));
+        rb_ary_store(dest, i, RARRAY_AREF(entries, ordering[i]));
+    }
+    return dest;
+}
+
+static VALUE
+context_leave(VALUE ctx)
+{
+    ((VersionSorterContext *)ctx)->busy = 0;
+    return Qnil;
+}
+
+/*
+ * Run `func` with `ctx` marked busy. No Ruby code runs while a context is
+ * in use, but a Sorter shared between threads, or used again from the
+ * to_str of an entry, must still fail loudly rather than corrupt it.
+ */
+static VALUE
+with_context(VersionSorterContext *ctx, VALUE (*func)(VALUE), void *call)
+{
+    if (ctx->busy) {
+        rb_raise(rb_eRuntimeError, "VersionSorter::Sorter is already in use");
+    }
+    ctx->busy = 1;
+    return rb_ensure(func, (VALUE)call, context_leave, (VALUE)ctx);
+}
+
+static VALUE
+sort_call(VALUE arg)
+{
+    SortCall *call = (SortCall *)arg;
+    add_entries(call->ctx, call->entries, call->len);
+    return ordered_entries(call->entries, version_sorter_context_finish(call->ctx, call->len), call->len);
+}
+
+static VALUE
+sort_with_context(VersionSorterContext *ctx, VALUE list)
+{
+    SortCall call;
+    VALUE dest;
+
+    call.ctx = ctx;
+    call.entries = resolve_list(list);
+    call.len = RARRAY_LEN(call.entries) / 2;
+    dest = with_context(ctx, sort_call, &call);
+    RB_GC_GUARD(call.entries);
+    return dest;
+}
+
+static VALUE
+latest_per_line_call(VALUE arg)
+{
+    SortCall *call = (SortCall *)arg;
+    size_t count;
+    int *ordering;
+
+    add_entries(call->ctx, call->entries, call->len);
+    ordering = version_sorter_context_latest_per_line(call->ctx, call->len, call->depth, &count);
+    if (ordering == NULL) {
+        DIE("ERROR: Not enough memory to sort versions")
+    }
+    return ordered_entries(call->entries, ordering, count);
+}
+
+static VALUE
+latest_per_line_with_context(VersionSorterContext *ctx, VALUE list, VALUE depth)
+{
+    SortCall call;
+    VALUE dest;
+
+    call.ctx = ctx;
+    call.depth = 2;
+    if (depth != Qundef) {
+        call.depth = NUM2LONG(depth);
+        if (call.depth < 0) {
+            rb_raise(rb_eArgError, "negative depth");
+        }
+    }
+    call.entries = resolve_list(list);
+    call.len = RARRAY_LEN(call.entries) / 2;
+    dest = with_context(ctx, latest_per_line_call, &call);
+    RB_GC_GUARD(call.entries);
+    return dest;
+}
+
+typedef struct _LinesCall {
+    VersionSorterContext *ctx;
+    const char *ptr;
+    long *spans;
+    long len;
+    int reverse;
+} LinesCall;
+
+/*
+ * Sort the `len` offset/length pairs of `spans` into the second half of
+ * the array, out of the context, which a block may well sort with again.
+ */
+static VALUE
+sort_lines_call(VALUE arg)
+{
+    LinesCall *call = (LinesCall *)arg;
+    long *sorted = call->spans + call->len * 2, i, j;
+    int *ordering;
+
+    if (version_sorter_context_begin(call->ctx, call->len) < 0) {
+        DIE("ERROR: Not enough memory to sort versions")
+    }
+    for (i = 0; i < call->len; i++) {
+        if (version_sorter_context_add(call->ctx, i, call->ptr + call->spans[i * 2], call->spans[i * 2 + 1]) < 0) {
+            DIE("ERROR: Not enough memory to sort versions")
+        }
+    }
+    ordering = version_sorter_context_finish(call->ctx, call->len);
+
+    for (i = 0; i < call->len; i++) {
+        j = ordering[call->reverse ? call->len - 1 - i : i];
+        sorted[i * 2] = call->spans[j * 2];
+        sorted[i * 2 + 1] = call->spans[j * 2 + 1];
+    }
+    return Qnil;
+}
+
+/*
+ * Sorts the non-empty lines of `buffer` without a String per line: the
+ * lines are only spans of the buffer until they come out joined again, or
+ * one by one as shared substrings when there is a block.
+ */
+static VALUE
+sort_lines_with_context(VersionSorterContext *ctx, VALUE buffer, int reverse)
+{
+    const char *ptr, *end, *line, *nl;
+    long count = 1, len = 0, i, *spans, *sorted;
+    int trailing_newline;
+    LinesCall call;
+    VALUE v_spans, dest;
+
+    StringValue(buffer);
+    /* Shares the bytes, and they cannot change under us while we yield */
+    buffer = rb_str_new_frozen(buffer);
+    ptr = RSTRING_PTR(buffer);
+    end = ptr + RSTRING_LEN(buffer);
+
+    for (line = ptr; (nl = memchr(line, '\n', end - line)) != NULL; line = nl + 1) {
+        count++;
+    }
+    spans = ALLOCV_N(long, v_spans, count * 4);
+
+    for (line = ptr; line < end; line = nl + 1) {
+        if ((nl = memchr(line, '\n', end - line)) == NULL) {
+            nl = end;
+        }
+        if (nl > line) {
+            spans[len * 2] = line - ptr;
+            spans[len * 2 + 1] = nl - line;
+            len++;
+        }
+    }
+
+    call.ctx = ctx;
+    call.ptr = ptr;
+    call.spans = spans;
+    call.len = len;
+    call.reverse = reverse;
+    with_context(ctx, sort_lines_call, &call);
+    sorted = spans + len * 2;
+
+    if (rb_block_given_p()) {
+        for (i = 0; i < len; i++) {
+            rb_yield(rb_str_subseq(buffer, sorted[i * 2], sorted[i * 2 + 1]));
+        }
+        ALLOCV_END(v_spans);
+        return Qnil;
+    }
+
+    trailing_newline = end > ptr && end[-1] == '\n';
+    dest = rb_str_buf_new(RSTRING_LEN(buffer));
+    for (i = 0; i < len; i++) {
+        rb_str_buf_cat(dest, RSTRING_PTR(buffer) + sorted[i * 2], sorted[i * 2 + 1]);
+        if (i < len - 1 || trailing_newline) {
+            rb_str_buf_cat(dest, "\n", 1);
+        }
+    }
+    rb_enc_copy(dest, buffer);
+    ALLOCV_END(v_spans);
+    return dest;
+}
+
+typedef struct _ManyCall {
+    VersionSorterContext *ctx;
+    VALUE resolved;
+    size_t *lens;
+    int **orderings;
+    long count;
+    long total;
+    int threads;
+} ManyCall;
+
+static void *
+finish_many_without_gvl(void *arg)
+{
+    ManyCall *call = arg;
+    version_sorter_context_finish_many(call->ctx, call->lens, call->orderings, call->count, call->threads);
+    return NULL;
+}
+
+static VALUE
+sort_many_call(VALUE arg)
+{
+    ManyCall *call = (ManyCall *)arg;
+    long i, j, offset = 0, len;
+    const unsigned char *key;
+    size_t key_len;
+    VALUE entries, entry, dest;
+
+    if (version_sorter_context_begin(call->ctx, call->total) < 0) {
+        DIE("ERROR: Not enough memory to sort versions")
+    }
+    for (i = 0; i < call->count; i++) {
+        entries = RARRAY_AREF(call->resolved, i);
+        len = (long)call->lens[i];
+        for (j = 0; j < len; j++, offset++) {
+            entry = RARRAY_AREF(entries, len + j);
+            if (rb_version_sorter_version_key(entry, &key, &key_len)) {
+                version_sorter_context_add_key(call->ctx, offset, key, key_len);
+            } else if (version_sorter_context_add(call->ctx, offset, RSTRING_PTR(entry), RSTRING_LEN(entry)) < 0) {
+                DIE("ERROR: Not enough memory to sort versions")
+            }
+        }
+    }
+
+    /*
+     * Every key now lives in the context's arena or in a Version that
+     * `resolved` holds on to, so the workers need nothing from Ruby.
+     */
+    if (call->threads > 1) {
+        rb_thread_call_without_gvl(finish_many_without_gvl, call, NULL, NULL);
+    } else {
+        finish_many_without_gvl(call);
+    }
+
+    dest = rb_ary_new2(call->count);
+    for (i = 0; i < call->count; i++) {
+        rb_ary_store(dest, i, ordered_entries(RARRAY_AREF(call->resolved, i), call->orderings[i], call->lens[i]));
+    }
+    return dest;
+}
+
+/*
+ * Sorts every Array in `lists` in one go with `ctx`. The keys are all
+ * built on the calling thread, the same way sort builds them, and only
+ * the sorting itself is spread over `threads` workers, with the GVL
+ * released.
+ */
+static VALUE
+sort_many(VersionSorterContext *ctx, VALUE lists, int threads)
+{
+    ManyCall call;
+    long i;
+    int *c_ords;
+    VALUE v_ords, v_orderings, v_lens, dest;
+
+    Check_Type(lists, T_ARRAY);
+    call.ctx = ctx;
+    call.count = RARRAY_LEN(lists);
+    call.threads = threads;
+    call.total = 0;
+    call.resolved = rb_ary_tmp_new(call.count);
+    for (i = 0; i < call.count; i++) {
+        rb_ary_push(call.resolved, resolve_list(rb_ary_entry(lists, i)));
+    }
+
+    call.lens = ALLOCV_N(size_t, v_lens, call.count);
+    call.orderings = ALLOCV_N(int *, v_orderings, call.count);
+    for (i = 0; i < call.count; i++) {
+        call.lens[i] = RARRAY_LEN(RARRAY_AREF(call.resolved, i)) / 2;
+        call.total += call.lens[i];
     }
-    free(ordering);
+    c_ords = ALLOCV_N(int, v_ords, call.total);
+    for (i = 0; i < call.count; i++) {
+        call.orderings[i] = c_ords;
+        c_ords += call.lens[i];
+    }
+
+    dest = with_context(ctx, sort_many_call, &call);
+    RB_GC_GUARD(call.resolved);
+
+    ALLOCV_END(v_ords);
+    ALLOCV_END(v_orderings);
+    ALLOCV_END(v_lens);
 
     return dest;
 }
 
+VALUE
+rb_sort(VALUE obj, VALUE list)
+{
+    /*
+     * The scratch buffers go into a throwaway Sorter so the GC can still
+     * reclaim them if a non-String entry makes us raise halfway through.
+     */
+    VALUE sorter = rb_sorter_alloc(rb_cSorter);
+    VALUE dest = rb_sorter_sort(sorter, list);
+    rb_sorter_shrink(sorter);
+    return dest;
+}
+
 VALUE
 rb_rsort(VALUE obj, VALUE list)
 {
@@ -52,10 +451,218 @@ rb_rsort(VALUE obj, VALUE list)
     return dest;
 }
 
+/*
+ * VersionSorter.sort_many(lists, threads: 1)
+ *
+ * Sorts each Array in `lists` and returns the sorted Arrays, paying the
+ * setup cost once for the whole batch. With `threads` greater than one the
+ * lists are spread over that many native workers, which run without the
+ * GVL once the keys are built.
+ */
+VALUE
+rb_sort_many(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE lists, opts, threads = Qundef, sorter, dest;
+    VersionSorterContext *ctx;
+    int c_threads = 1;
+
+    rb_scan_args(argc, argv, "1:", &lists, &opts);
+    if (!NIL_P(opts)) {
+        rb_get_kwargs(opts, &id_threads, 0, 1, &threads);
+    }
+    if (threads != Qundef) {
+        c_threads = NUM2INT(threads);
+        if (c_threads < 1) {
+            rb_raise(rb_eArgError, "threads must be at least 1");
+        }
+    }
+    sorter = rb_sorter_alloc(rb_cSorter);
+    TypedData_Get_Struct(sorter, VersionSorterContext, &sorter_type, ctx);
+    dest = sort_many(ctx, lists, c_threads);
+    rb_sorter_shrink(sorter);
+    return dest;
+}
+
+/*
+ * VersionSorter.latest_per_line(list, depth: 2)
+ *
+ * The newest version of every release line in `list`, in sorted order,
+ * where a line is the versions that agree on their first `depth` runs of
+ * digits or letters: the latest 3.0.x, 3.1.x and 4.0.x at the default
+ * depth. It takes one pass over `list` and only sorts the winners.
+ */
+VALUE
+rb_latest_per_line(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE sorter = rb_sorter_alloc(rb_cSorter);
+    VALUE dest = rb_sorter_latest_per_line(argc, argv, sorter);
+    rb_sorter_shrink(sorter);
+    return dest;
+}
+
+/*
+ * VersionSorter.sort_lines(buffer, reverse: false)
+ * VersionSorter.sort_lines(buffer, reverse: false) { |line| ... }
+ *
+ * Sorts the lines of `buffer`, such as the output of `git tag`, without
+ * splitting it into an Array first. Empty lines are dropped. Returns the
+ * sorted lines as one String, ending in a newline if `buffer` did, or
+ * yields them one by one and returns nil when given a block;
+ * `enum_for(:sort_lines, buffer)` makes an Enumerator of them.
+ */
+VALUE
+rb_sort_lines(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE sorter = rb_sorter_alloc(rb_cSorter);
+    VALUE dest = rb_sorter_sort_lines(argc, argv, sorter);
+    rb_sorter_shrink(sorter);
+    return dest;
+}
+
+/*
+ * VersionSorter.sort_key(version)
+ *
+ * Returns a binary String whose bytewise order is the order of
+ * VersionSorter.sort, to store in an indexed binary column and let the
+ * database do the ordering. See README for the encoding.
+ */
+VALUE
+rb_sort_key(VALUE obj, VALUE version)
+{
+    const unsigned char *key;
+    size_t key_len;
+    VALUE dest;
+
+    if (rb_version_sorter_version_key(version, &key, &key_len)) {
+        /* Same bytes version_sorter_sort_key would write, without reparsing */
+        dest = rb_str_new(NULL, key_len + 1);
+        RSTRING_PTR(dest)[0] = VERSION_SORTER_KEY_FORMAT;
+        memcpy(RSTRING_PTR(dest) + 1, key, key_len);
+        return dest;
+    }
+
+    StringValue(version);
+    key_len = VERSION_SORTER_SORT_KEY_MAX(RSTRING_LEN(version));
+    dest = rb_str_buf_new(key_len);
+    key_len = version_sorter_sort_key(RSTRING_PTR(version), RSTRING_LEN(version), (unsigned char *)RSTRING_PTR(dest), key_len);
+    rb_str_set_len(dest, key_len);
+    return dest;
+}
+
+VALUE
+rb_sorter_alloc(VALUE klass)
+{
+    VersionSorterContext *ctx = version_sorter_context_new();
+    return TypedData_Wrap_Struct(klass, &sorter_type, ctx);
+}
+
+/*
+ * Sorts `list` like VersionSorter.sort, reusing the buffers left over from
+ * this sorter's previous calls.
+ */
+VALUE
+rb_sorter_sort(VALUE self, VALUE list)
+{
+    VersionSorterContext *ctx;
+    TypedData_Get_Struct(self, VersionSorterContext, &sorter_type, ctx);
+    return sort_with_context(ctx, list);
+}
+
+VALUE
+rb_sorter_rsort(VALUE self, VALUE list)
+{
+    VALUE dest = rb_sorter_sort(self, list);
+    rb_ary_reverse(dest);
+    return dest;
+}
+
+VALUE
+rb_sorter_sort_many(VALUE self, VALUE lists)
+{
+    VersionSorterContext *ctx;
+    TypedData_Get_Struct(self, VersionSorterContext, &sorter_type, ctx);
+    return sort_many(ctx, lists, 1);
+}
+
+VALUE
+rb_sorter_latest_per_line(int argc, VALUE *argv, VALUE self)
+{
+    VersionSorterContext *ctx;
+    VALUE list, opts, depth = Qundef;
+
+    rb_scan_args(argc, argv, "1:", &list, &opts);
+    if (!NIL_P(opts)) {
+        rb_get_kwargs(opts, &id_depth, 0, 1, &depth);
+    }
+    TypedData_Get_Struct(self, VersionSorterContext, &sorter_type, ctx);
+    return latest_per_line_with_context(ctx, list, depth);
+}
+
+VALUE
+rb_sorter_sort_lines(int argc, VALUE *argv, VALUE self)
+{
+    VersionSorterContext *ctx;
+    VALUE buffer, opts, reverse = Qundef;
+
+    rb_scan_args(argc, argv, "1:", &buffer, &opts);
+    if (!NIL_P(opts)) {
+        rb_get_kwargs(opts, &id_reverse, 0, 1, &reverse);
+    }
+    TypedData_Get_Struct(self, VersionSorterContext, &sorter_type, ctx);
+    return sort_lines_with_context(ctx, buffer, reverse != Qundef && RTEST(reverse));
+}
+
+/*
+ * Gives all the retained buffers back to the allocator. The sorter stays
+ * usable and grows them again on its next sort.
+ */
+VALUE
+rb_sorter_shrink(VALUE self)
+{
+    VersionSorterContext *ctx;
+    TypedData_Get_Struct(self, VersionSorterContext, &sorter_type, ctx);
+    if (ctx->busy) {
+        rb_raise(rb_eRuntimeError, "VersionSorter::Sorter is already in use");
+    }
+    version_sorter_context_shrink(ctx);
+    return self;
+}
+
+/*
+ * The extension is Ractor-safe: everything static below is set up once
+ * here and never written again, and all scratch space in memory belongs
+ * to the call or to a Sorter, which cannot be shared between Ractors.
+ * On disk, Index writers use their own temporary files and take turns on
+ * the index's lock file, so they may run in parallel too.
+ */
 void
 Init_version_sorter(void)
 {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    rb_ext_ractor_safe(true);
+#endif
+
+    id_threads = rb_intern("threads");
+    id_depth = rb_intern("depth");
+    id_reverse = rb_intern("reverse");
+
     rb_version_sorter_module = rb_define_module("VersionSorter");
     rb_define_module_function(rb_version_sorter_module, "sort", rb_sort, 1);
     rb_define_module_function(rb_version_sorter_module, "rsort", rb_rsort, 1);
+    rb_define_module_function(rb_version_sorter_module, "sort_many", rb_sort_many, -1);
+    rb_define_module_function(rb_version_sorter_module, "sort_key", rb_sort_key, 1);
+    rb_define_module_function(rb_version_sorter_module, "latest_per_line", rb_latest_per_line, -1);
+    rb_define_module_function(rb_version_sorter_module, "sort_lines", rb_sort_lines, -1);
+
+    rb_cSorter = rb_define_class_under(rb_version_sorter_module, "Sorter", rb_cObject);
+    rb_define_alloc_func(rb_cSorter, rb_sorter_alloc);
+    rb_define_method(rb_cSorter, "sort", rb_sorter_sort, 1);
+    rb_define_method(rb_cSorter, "rsort", rb_sorter_rsort, 1);
+    rb_define_method(rb_cSorter, "sort_many", rb_sorter_sort_many, 1);
+    rb_define_method(rb_cSorter, "latest_per_line", rb_sorter_latest_per_line, -1);
+    rb_define_method(rb_cSorter, "sort_lines", rb_sorter_sort_lines, -1);
+    rb_define_method(rb_cSorter, "shrink", rb_sorter_shrink, 0);
+
+    Init_version(rb_version_sorter_module);
+    Init_version_index(rb_version_sorter_module);
 }
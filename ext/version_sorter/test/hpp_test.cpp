@@ -0,0 +1,143 @@
+/*
+ *  hpp_test.cpp
+ *  version_sorter
+ *
+ *  Checks version_sorter.hpp against the C sorter. Run it with
+ *  `rake test:hpp`, or build it with a C++17 compiler against
+ *  version_sorter.c and pass it the path of test/tags.txt.
+ *
+ */
+
+#include <array>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "version_sorter.hpp"
+extern "C" {
+#include "version_sorter.h"
+}
+
+using version_sorter::version_compare;
+
+static_assert(version_compare("1.0.9", "1.0.10") < 0);
+static_assert(version_compare("1.0.10", "1.0.9") > 0);
+static_assert(version_compare("1.0.9", "1.0.9a") < 0);
+static_assert(version_compare("1.0", "1-0") == 0);
+static_assert(version_compare("", "0") < 0);
+static_assert(version_compare("yui3-990", "yui3-999") < 0);
+static_assert(version_sorter::version_less{}("2.0", "10.0"));
+
+struct Release {
+    std::string tag;
+    int id;
+};
+
+static std::vector<std::string>
+read_lines(const char *path)
+{
+    std::ifstream file(path);
+    std::vector<std::string> lines;
+    std::string line;
+
+    assert(file);
+    while (std::getline(file, line)) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+/* version_sort, with and without a projection, matches version_sorter_sort */
+static void
+test_version_sort(const std::vector<std::string> &versions)
+{
+    std::vector<char *> list;
+    std::vector<Release> releases;
+    std::vector<std::string_view> views(versions.begin(), versions.end());
+    std::size_t i;
+
+    for (i = 0; i < versions.size(); i++) {
+        list.push_back(const_cast<char *>(versions[i].c_str()));
+        releases.push_back({versions[i], static_cast<int>(i)});
+    }
+    std::free(version_sorter_sort(list.data(), list.size()));
+
+    version_sorter::version_sort(views);
+    version_sorter::version_sort(releases.begin(), releases.end(), &Release::tag);
+
+    for (i = 0; i < versions.size(); i++) {
+        /* Same strings, and, since both are stable, the same ties too */
+        assert(views[i].data() == list[i]);
+        assert(versions[releases[i].id].c_str() == list[i]);
+    }
+}
+
+/* version_key and sort_key write the very same bytes as the C functions */
+static void
+test_version_key(const std::vector<std::string> &versions)
+{
+    std::vector<unsigned char> key;
+    std::size_t key_len;
+
+    for (const auto &version : versions) {
+        key.resize(VERSION_SORTER_SORT_KEY_MAX(version.size()) + 1);
+
+        key_len = version_sorter_key(version.data(), version.size(), key.data(), key.size());
+        assert(version_sorter::version_key(version) == std::string(key.begin(), key.begin() + key_len));
+
+        key_len = version_sorter_sort_key(version.data(), version.size(), key.data(), key.size());
+        assert(version_sorter::sort_key(version) == std::string(key.begin(), key.begin() + key_len));
+    }
+}
+
+static void
+test_ties_and_containers()
+{
+    static const char *spellings[] = {"2.0", "1.0", "2-0", "1-0", "1_0", "2_0"};
+    std::array<const char *, 4> tags{"1-0", "2.0", "1.0", "1.10"};
+    std::map<std::string, int, version_sorter::version_less> by_tag{{"1.10", 1}, {"1.9", 2}};
+    std::vector<Release> releases;
+    std::size_t i;
+
+    version_sorter::version_sort(tags);
+    assert(std::strcmp(tags[0], "1-0") == 0 && std::strcmp(tags[1], "1.0") == 0);
+    assert(std::strcmp(tags[3], "2.0") == 0);
+
+    /* Enough ties that an unstable sort would shuffle them */
+    for (i = 0; i < 1000; i++) {
+        releases.push_back({spellings[(i * 7) % 6], static_cast<int>(i)});
+    }
+    version_sorter::version_sort(releases.begin(), releases.end(), &Release::tag);
+    for (i = 1; i < releases.size(); i++) {
+        assert(version_compare(releases[i - 1].tag, releases[i].tag) < 0 || releases[i - 1].id < releases[i].id);
+    }
+
+    assert(by_tag.begin()->second == 2);
+    assert(by_tag.find(std::string_view("1.10")) != by_tag.end());
+}
+
+int
+main(int argc, char **argv)
+{
+    std::vector<std::string> versions;
+
+    if (argc != 2) {
+        std::cerr << "usage: " << argv[0] << " tags.txt\n";
+        return EXIT_FAILURE;
+    }
+    versions = read_lines(argv[1]);
+    assert(!versions.empty());
+
+    test_version_sort(versions);
+    test_version_key(versions);
+    test_ties_and_containers();
+
+    std::cout << "version_sorter.hpp: " << versions.size() << " versions OK\n";
+    return EXIT_SUCCESS;
+}
@@ -18,21 +18,17 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/times.h>
 #include "version_sorter.h"
+#include "version_index.h"
 
 #define ARRAY_LENGH(x) \
     (sizeof(x)/sizeof(x[0]))
 
-extern VersionSortingItem * version_sorting_item_init(const char *);
-extern void version_sorting_item_free(VersionSortingItem *);
-extern void version_sorting_item_add_piece(VersionSortingItem *, char *);
-extern void setup_version_regex(void);
-extern void parse_version_word(VersionSortingItem *);
-extern void create_normalized_version(VersionSortingItem *, const int);
 extern int compare_by_version(const void *, const void *);
 
 static char *unsorted[] = {
@@ -69,26 +65,180 @@ test_sort(void **state)
 }
 
 void
-test_parse_version_word(void **state)
+test_version_sorter_key(void **state)
 {
-    VersionSortingItem *vsi = version_sorting_item_init("1.0.10a");
-    
-    assert((strcmp("1", vsi->head->str)) == 0);
-    assert((strcmp("0", vsi->head->next->str)) == 0);
-    assert((strcmp("10", vsi->head->next->next->str)) == 0);
-    assert((strcmp("a", vsi->tail->str)) == 0);
-    
-    version_sorting_item_free(vsi);
+    unsigned char key[VERSION_SORTER_KEY_MAX(7)], other[VERSION_SORTER_KEY_MAX(6)];
+    size_t key_len = version_sorter_key("1.0.10a", 7, key, sizeof(key));
+    size_t other_len = version_sorter_key("1.0.10", 6, other, sizeof(other));
+
+    assert(key_len == 13);
+    assert(memcmp("\x01\x01" "1" "\x01\x01" "0" "\x01\x02" "10" "\x02" "a\0", key, key_len) == 0);
+    assert(version_sorter_key("1.0.10a", 7, NULL, 0) == key_len);
+
+    assert(version_sorter_key_compare(other, other_len, key, key_len) < 0);
+    assert(version_sorter_key_compare(key, key_len, other, other_len) > 0);
+    assert(version_sorter_key_compare(key, key_len, key, key_len) == 0);
+
+    /* Bytes outside ASCII only separate runs */
+    other_len = version_sorter_key("1\xc3\xa9" "0", 4, other, sizeof(other));
+    assert(other_len == 6 && memcmp("\x01\x01" "1" "\x01\x01" "0", other, other_len) == 0);
+}
+
+void
+test_version_sorter_sort_key(void **state)
+{
+    unsigned char key[64], prev[64];
+    size_t key_len, prev_len = 0;
+    int i;
+
+    key_len = version_sorter_sort_key("1.0.10a", 7, key, sizeof(key));
+    assert(key_len == 14 && key[0] == VERSION_SORTER_KEY_FORMAT);
+    assert(memcmp("\x01\x01" "1" "\x01\x01" "0" "\x01\x02" "10" "\x02" "a\0", key + 1, key_len - 1) == 0);
+    assert(version_sorter_sort_key("1.0.10a", 7, NULL, 0) == key_len);
+
+    for (i = 0; i < ARRAY_LENGH(expected_sorted); i++) {
+        key_len = version_sorter_sort_key(expected_sorted[i], strlen(expected_sorted[i]), key, sizeof(key));
+        assert(key_len <= VERSION_SORTER_SORT_KEY_MAX(strlen(expected_sorted[i])));
+        if (i > 0) {
+            assert(version_sorter_key_compare(prev, prev_len, key, key_len) <= 0);
+        }
+        memcpy(prev, key, key_len);
+        prev_len = key_len;
+    }
 }
 
 void
-test_create_normalized_version(void **state)
+test_latest_per_line(void **state)
 {
-    VersionSortingItem *vsi = version_sorting_item_init("1.0.10a");
+    static char *versions[] = { "3.1.2", "3.0.9", "4.0.1", "3.1.10", "3.0.10", "4.0.0", "3" };
+    static char *latest[] = { "3", "3.0.10", "3.1.10", "4.0.1" };
+    VersionSorterContext *ctx = version_sorter_context_new();
+    size_t count, i;
+    int *ordering;
+
+    version_sorter_context_begin(ctx, ARRAY_LENGH(versions));
+    for (i = 0; i < ARRAY_LENGH(versions); i++) {
+        version_sorter_context_add(ctx, i, versions[i], strlen(versions[i]));
+    }
+    ordering = version_sorter_context_latest_per_line(ctx, ARRAY_LENGH(versions), 2, &count);
+
+    assert(count == ARRAY_LENGH(latest));
+    for (i = 0; i < count; i++) {
+        assert(strcmp(versions[ordering[i]], latest[i]) == 0);
+    }
+
+    version_sorter_context_free(ctx);
+}
+
+void
+test_context_sort(void **state)
+{
+    VersionSorterContext *ctx = version_sorter_context_new();
+    char **list;
+    int i, j;
+
+    for (j = 0; j < 2; j++) {
+        list = version_sorter_context_list(ctx, ARRAY_LENGH(expected_sorted));
+        for (i = 0; i < ARRAY_LENGH(expected_sorted); i++) {
+            list[i] = expected_sorted[ARRAY_LENGH(expected_sorted) - i - 1];
+        }
+        version_sorter_context_sort(ctx, list, ARRAY_LENGH(expected_sorted));
+        for (i = 0; i < ARRAY_LENGH(expected_sorted); i++) {
+            assert(strcmp(list[i], expected_sorted[i]) == 0);
+        }
+    }
+    version_sorter_context_shrink(ctx);
+    assert(ctx->items == NULL && ctx->arena == NULL);
+
+    version_sorter_context_free(ctx);
+}
+
+void
+test_sort_many(void **state)
+{
+    char *first[] = { "2.0", "1.0.10", "1.0.9" };
+    char *second[] = { "yui3-999", "1.0.9a", "yui3-990" };
+    char **lists[] = { first, second };
+    size_t lens[] = { 3, 3 };
+    int first_ordering[3], second_ordering[3];
+    int *orderings[] = { first_ordering, second_ordering };
+
+    assert(version_sorter_sort_many(lists, lens, orderings, 2, 2) == 0);
+
+    assert(strcmp(first[0], "1.0.9") == 0 && first_ordering[0] == 2);
+    assert(strcmp(first[2], "2.0") == 0 && first_ordering[2] == 0);
+    assert(strcmp(second[0], "1.0.9a") == 0 && second_ordering[0] == 1);
+    assert(strcmp(second[2], "yui3-999") == 0 && second_ordering[2] == 0);
+}
+
+void
+test_sort_many_thread_count(void **state)
+{
+    char *versions[200][2];
+    char **lists[200];
+    size_t lens[200];
+    int ordering[200][2], *orderings[200];
+    int i, threads[] = { -1, 0, 1000 }, t;
+
+    for (t = 0; t < ARRAY_LENGH(threads); t++) {
+        for (i = 0; i < 200; i++) {
+            versions[i][0] = "2.0";
+            versions[i][1] = "1.0";
+            lists[i] = versions[i];
+            lens[i] = 2;
+            orderings[i] = ordering[i];
+        }
+        assert(version_sorter_sort_many(lists, lens, orderings, 200, threads[t]) == 0);
+        for (i = 0; i < 200; i++) {
+            assert(strcmp(versions[i][0], "1.0") == 0 && ordering[i][0] == 1);
+        }
+    }
+}
+
+void
+test_context_finish_many(void **state)
+{
+    const char *versions[] = { "2.0", "1.0\0 10", "1.0.9", "1.10", "1.0", "1.9" };
+    size_t sizes[] = { 3, 7, 5, 4, 3, 3 };
+    size_t lens[] = { 3, 0, 3 };
+    int first_ordering[3], second_ordering[1], third_ordering[3];
+    int *orderings[] = { first_ordering, second_ordering, third_ordering };
+    VersionSorterContext *ctx = version_sorter_context_new();
+    size_t i;
+
+    assert(version_sorter_context_begin(ctx, 6) == 0);
+    for (i = 0; i < 6; i++) {
+        assert(version_sorter_context_add(ctx, i, versions[i], sizes[i]) == 0);
+    }
+    version_sorter_context_finish_many(ctx, lens, orderings, 3, 2);
+
+    assert(first_ordering[0] == 2 && first_ordering[1] == 1 && first_ordering[2] == 0);
+    assert(third_ordering[0] == 1 && third_ordering[1] == 2 && third_ordering[2] == 0);
+    version_sorter_context_free(ctx);
+}
+
+void
+test_version_index(void **state)
+{
+    char path[] = "/tmp/version_index_testXXXXXX";
+    VersionIndex idx;
+    size_t pos, len;
+    int fd = mkstemp(path);
+
+    close(fd);
+    assert(version_index_build(path, unsorted, ARRAY_LENGH(unsorted)) == VERSION_INDEX_OK);
+    assert(version_index_open(&idx, path) == VERSION_INDEX_OK);
+    assert(version_index_verify(&idx) == VERSION_INDEX_OK);
 
-    assert((strcmp(" 1 010 a", vsi->normalized)) == 0);
+    assert(idx.count == ARRAY_LENGH(expected_sorted));
+    assert(strcmp(version_index_get(&idx, 0, &len), expected_sorted[0]) == 0 && len == 5);
+    assert(version_index_lower_bound(&idx, "1.0.10", 6) == 4);
+    assert(version_index_upper_bound(&idx, "2", 1) == 7);
+    assert(version_index_find(&idx, "yui3-990", 8, &pos) == 1 && pos == 9);
+    assert(version_index_find(&idx, "yui3-991", 8, &pos) == 0);
 
-    version_sorting_item_free(vsi);
+    version_index_close(&idx);
+    unlink(path);
 }
 
 static void 
@@ -116,8 +266,15 @@ main(void)
 {    
     const UnitTest tests[] = {
         unit_test(test_array_length),
-        unit_test(test_parse_version_word),
+        unit_test(test_version_sorter_key),
+        unit_test(test_version_sorter_sort_key),
         unit_test(test_sort),
+        unit_test(test_latest_per_line),
+        unit_test(test_context_sort),
+        unit_test(test_sort_many),
+        unit_test(test_sort_many_thread_count),
+        unit_test(test_context_finish_many),
+        unit_test(test_version_index),
         unit_test(benchmark_sort),
     };
     return run_tests(tests);
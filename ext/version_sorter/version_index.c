@@ -0,0 +1,673 @@
+/*
+ *  version_index.c
+ *  version_sorter
+ *
+ *  Building, appending to and reading the mmap'ed version index described
+ *  in version_index.h.
+ *
+ */
+
+#include "version_index.h"
+
+#if HAVE_VERSION_INDEX
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "version_sorter.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef struct _IndexEntry {
+    const unsigned char *key;
+    size_t key_len;
+    const char *str;
+    size_t len;
+} IndexEntry;
+
+typedef struct _IndexWriter {
+    FILE *file;
+    uint64_t checksum;
+} IndexWriter;
+
+
+static void put_u32(unsigned char *, uint32_t);
+static void put_u64(unsigned char *, uint64_t);
+static uint32_t get_u32(const unsigned char *);
+static uint64_t get_u64(const unsigned char *);
+static uint64_t checksum_update(uint64_t, const unsigned char *, size_t);
+static int compare_entries(const void *, const void *);
+static int writer_put(IndexWriter *, const void *, size_t);
+static int write_index(const char *, const IndexEntry *, size_t);
+static unsigned char * make_entries(char **, size_t, IndexEntry *);
+static size_t unique_entries(IndexEntry *, size_t);
+static int validate_index(VersionIndex *);
+static size_t search(const VersionIndex *, const char *, size_t, int);
+
+
+void
+put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+void
+put_u64(unsigned char *p, uint64_t v)
+{
+    put_u32(p, (uint32_t)(v & 0xFFFFFFFFU));
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+uint32_t
+get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint64_t
+get_u64(const unsigned char *p)
+{
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+uint64_t
+checksum_update(uint64_t hash, const unsigned char *p, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Version order, with the bytes of the strings breaking ties */
+int
+compare_entries(const void *a, const void *b)
+{
+    const IndexEntry *ea = a, *eb = b;
+    int cmp = version_sorter_key_compare(ea->key, ea->key_len, eb->key, eb->key_len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    cmp = memcmp(ea->str, eb->str, ea->len < eb->len ? ea->len : eb->len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (ea->len > eb->len) - (ea->len < eb->len);
+}
+
+int
+writer_put(IndexWriter *w, const void *data, size_t len)
+{
+    w->checksum = checksum_update(w->checksum, data, len);
+    return fwrite(data, 1, len, w->file) == len ? 0 : -1;
+}
+
+/*
+ * Write the sorted `entries` to a temporary file next to `path` and rename
+ * it into place, so readers see either the old index or the new one. The
+ * temporary file has a unique name, so concurrent writers never share it.
+ */
+int
+write_index(const char *path, const IndexEntry *entries, size_t count)
+{
+    unsigned char header[VERSION_INDEX_HEADER_SIZE], entry[VERSION_INDEX_ENTRY_SIZE];
+    uint64_t keys_len = 0, strings_len = 0, keys_off, strings_off;
+    IndexWriter w;
+    char *tmp_path;
+    size_t i;
+    int fd, saved_errno;
+
+    for (i = 0; i < count; i++) {
+        keys_len += entries[i].key_len;
+        strings_len += entries[i].len + 1;
+    }
+    if (keys_len > UINT32_MAX || strings_len > UINT32_MAX) {
+        return VERSION_INDEX_TOO_BIG;
+    }
+    keys_off = VERSION_INDEX_HEADER_SIZE + (uint64_t)count * VERSION_INDEX_ENTRY_SIZE;
+    strings_off = keys_off + keys_len;
+
+    /* Callers hold the index lock, so report running out of memory instead of raising */
+    tmp_path = malloc(strlen(path) + 16);
+    if (tmp_path == NULL) {
+        errno = ENOMEM;
+        return VERSION_INDEX_ERRNO;
+    }
+    sprintf(tmp_path, "%s.tmpXXXXXX", path);
+
+    /* mkstemp makes it 0600; give the index the usual mode of a new file */
+    w.checksum = FNV_OFFSET;
+    w.file = NULL;
+    fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        free(tmp_path);
+        return VERSION_INDEX_ERRNO;
+    }
+    if (fchmod(fd, 0644) != 0 || (w.file = fdopen(fd, "wb")) == NULL) {
+        saved_errno = errno;
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        errno = saved_errno;
+        return VERSION_INDEX_ERRNO;
+    }
+
+    memset(header, 0, sizeof(header));
+    if (fwrite(header, 1, sizeof(header), w.file) != sizeof(header)) {
+        goto fail;
+    }
+
+    keys_len = strings_len = 0;
+    for (i = 0; i < count; i++) {
+        put_u32(entry, (uint32_t)keys_len);
+        put_u32(entry + 4, (uint32_t)entries[i].key_len);
+        put_u32(entry + 8, (uint32_t)strings_len);
+        put_u32(entry + 12, (uint32_t)entries[i].len);
+        if (writer_put(&w, entry, sizeof(entry)) < 0) {
+            goto fail;
+        }
+        keys_len += entries[i].key_len;
+        strings_len += entries[i].len + 1;
+    }
+    for (i = 0; i < count; i++) {
+        if (writer_put(&w, entries[i].key, entries[i].key_len) < 0) {
+            goto fail;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        /* Pull in the terminator too; mapped and new strings both have one */
+        if (writer_put(&w, entries[i].str, entries[i].len + 1) < 0) {
+            goto fail;
+        }
+    }
+
+    memcpy(header, VERSION_INDEX_MAGIC, sizeof(VERSION_INDEX_MAGIC));
+    put_u32(header + 8, VERSION_INDEX_FORMAT);
+    put_u32(header + 12, 0);
+    put_u64(header + 16, count);
+    put_u64(header + 24, VERSION_INDEX_HEADER_SIZE);
+    put_u64(header + 32, keys_off);
+    put_u64(header + 40, strings_off);
+    put_u64(header + 48, strings_off + strings_len);
+    put_u64(header + 56, w.checksum);
+
+    if (fseek(w.file, 0, SEEK_SET) != 0 ||
+        fwrite(header, 1, sizeof(header), w.file) != sizeof(header) ||
+        fflush(w.file) != 0 ||
+        fsync(fileno(w.file)) != 0) {
+        goto fail;
+    }
+    if (fclose(w.file) != 0) {
+        w.file = NULL;
+        goto fail;
+    }
+    if (rename(tmp_path, path) != 0) {
+        w.file = NULL;
+        goto fail;
+    }
+    free(tmp_path);
+    return VERSION_INDEX_OK;
+
+fail:
+    saved_errno = errno;
+    if (w.file != NULL) {
+        fclose(w.file);
+    }
+    unlink(tmp_path);
+    free(tmp_path);
+    errno = saved_errno;
+    return VERSION_INDEX_ERRNO;
+}
+
+/*
+ * Take an exclusive lock on `path`.lock, creating it if needed, and return
+ * its descriptor, or -1 with errno set. Without `wait` this fails with
+ * EWOULDBLOCK instead of blocking while another writer holds the lock, so
+ * callers such as an interpreter can wait for it their own way. Writers
+ * hold it from reading the old index to renaming the new one, so no update
+ * is lost to another writer, in this process or any other. flock locks
+ * belong to the open file, so two threads of the same process exclude
+ * each other as well. Readers never lock.
+ */
+int
+version_index_lock(const char *path, int wait)
+{
+    char *lock_path = malloc(strlen(path) + 6);
+    int fd, saved_errno;
+
+    if (lock_path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    sprintf(lock_path, "%s.lock", path);
+    fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    free(lock_path);
+    if (fd < 0) {
+        return -1;
+    }
+    while (flock(fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) != 0) {
+        if (errno != EINTR) {
+            saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    return fd;
+}
+
+void
+version_index_unlock(int fd)
+{
+    int saved_errno = errno;
+    /* Closing the descriptor drops the lock */
+    close(fd);
+    errno = saved_errno;
+}
+
+/*
+ * Fill `entries` with the `len` versions of `list` and their keys, sorted.
+ * Returns the buffer holding the keys, which the caller frees, or NULL if
+ * memory runs out.
+ */
+unsigned char *
+make_entries(char **list, size_t len, IndexEntry *entries)
+{
+    size_t i, keys_size = 1, pos = 0;
+    unsigned char *keys;
+
+    for (i = 0; i < len; i++) {
+        entries[i].str = list[i];
+        entries[i].len = strlen(list[i]);
+        keys_size += VERSION_SORTER_KEY_MAX(entries[i].len);
+    }
+    keys = malloc(keys_size);
+    if (keys == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < len; i++) {
+        entries[i].key = keys + pos;
+        entries[i].key_len = version_sorter_key(entries[i].str, entries[i].len, keys + pos, keys_size - pos);
+        pos += entries[i].key_len;
+    }
+    qsort(entries, len, sizeof(IndexEntry), &compare_entries);
+    return keys;
+}
+
+/* Drop repeated versions from the sorted `entries`, returning the new count */
+size_t
+unique_entries(IndexEntry *entries, size_t count)
+{
+    size_t i, kept = 0;
+
+    for (i = 0; i < count; i++) {
+        if (kept > 0 && compare_entries(&entries[kept - 1], &entries[i]) == 0) {
+            continue;
+        }
+        entries[kept++] = entries[i];
+    }
+    return kept;
+}
+
+/*
+ * Write a new index at `path` holding the `len` versions of `list`,
+ * replacing any index already there, while the caller holds the lock of
+ * version_index_lock. Nothing here raises or needs an interpreter lock:
+ * running out of memory is reported as ENOMEM.
+ */
+int
+version_index_build_locked(const char *path, char **list, size_t len)
+{
+    IndexEntry *entries = malloc((len ? len : 1) * sizeof(IndexEntry));
+    unsigned char *keys = NULL;
+    int status;
+
+    if (entries == NULL || (keys = make_entries(list, len, entries)) == NULL) {
+        free(entries);
+        errno = ENOMEM;
+        return VERSION_INDEX_ERRNO;
+    }
+    status = write_index(path, entries, unique_entries(entries, len));
+    free(keys);
+    free(entries);
+    return status;
+}
+
+/*
+ * Merge the `len` versions of `list` into the index at `path`, creating it
+ * if needed, while the caller holds the lock of version_index_lock. Only
+ * the new versions get sorted; they are then merged with the already
+ * sorted entries and the result is compacted into a fresh file that
+ * atomically replaces the old one. Processes that still have the old index
+ * mapped keep reading it until they reopen it. Like the build, this never
+ * raises.
+ */
+int
+version_index_append_locked(const char *path, char **list, size_t len)
+{
+    VersionIndex old;
+    IndexEntry *added, *merged, current;
+    unsigned char *keys = NULL;
+    const unsigned char *entry;
+    size_t i = 0, j = 0, count = 0;
+    int status;
+
+    added = malloc((len ? len : 1) * sizeof(IndexEntry));
+    if (added == NULL || (keys = make_entries(list, len, added)) == NULL) {
+        free(added);
+        errno = ENOMEM;
+        return VERSION_INDEX_ERRNO;
+    }
+
+    status = version_index_open(&old, path);
+    if (status == VERSION_INDEX_OK) {
+        /* All of it gets copied into the new index, so check all of it */
+        if ((status = version_index_verify(&old)) != VERSION_INDEX_OK) {
+            version_index_close(&old);
+        }
+    } else if (status == VERSION_INDEX_ERRNO && errno == ENOENT) {
+        memset(&old, 0, sizeof(VersionIndex));
+        status = VERSION_INDEX_OK;
+    }
+    if (status != VERSION_INDEX_OK) {
+        free(keys);
+        free(added);
+        return status;
+    }
+
+    merged = malloc((old.count + len + 1) * sizeof(IndexEntry));
+    if (merged == NULL) {
+        version_index_close(&old);
+        free(keys);
+        free(added);
+        errno = ENOMEM;
+        return VERSION_INDEX_ERRNO;
+    }
+
+    while (i < old.count || j < len) {
+        if (i < old.count) {
+            entry = old.entries + i * VERSION_INDEX_ENTRY_SIZE;
+            current.key = old.keys + get_u32(entry);
+            current.key_len = get_u32(entry + 4);
+            current.str = old.strings + get_u32(entry + 8);
+            current.len = get_u32(entry + 12);
+        }
+        if (i < old.count && (j == len || compare_entries(&current, &added[j]) <= 0)) {
+            merged[count++] = current;
+            i++;
+        } else {
+            merged[count++] = added[j++];
+        }
+    }
+
+    status = write_index(path, merged, unique_entries(merged, count));
+
+    free(keys);
+    free(merged);
+    free(added);
+    version_index_close(&old);
+    return status;
+}
+
+/*
+ * Same as version_index_build_locked, waiting for the lock first.
+ * Concurrent builds and appends take turns on the lock file next to `path`.
+ */
+int
+version_index_build(const char *path, char **list, size_t len)
+{
+    int status, lock = version_index_lock(path, 1);
+
+    if (lock < 0) {
+        return VERSION_INDEX_ERRNO;
+    }
+    status = version_index_build_locked(path, list, len);
+    version_index_unlock(lock);
+    return status;
+}
+
+/* Same as version_index_append_locked, waiting for the lock first */
+int
+version_index_append(const char *path, char **list, size_t len)
+{
+    int status, lock = version_index_lock(path, 1);
+
+    if (lock < 0) {
+        return VERSION_INDEX_ERRNO;
+    }
+    status = version_index_append_locked(path, list, len);
+    version_index_unlock(lock);
+    return status;
+}
+
+/*
+ * Check what opening needs to trust the layout: the header, the offsets
+ * and the size. This only touches the first page, so opening stays cheap
+ * and leaves the rest of the file to be paged in, and shared, on demand.
+ * The contents are checked by version_index_verify.
+ */
+int
+validate_index(VersionIndex *idx)
+{
+    const unsigned char *map = idx->map;
+    uint64_t entries_off, keys_off, strings_off, file_size;
+
+    if (idx->map_len < VERSION_INDEX_HEADER_SIZE ||
+        memcmp(map, VERSION_INDEX_MAGIC, sizeof(VERSION_INDEX_MAGIC)) != 0 ||
+        get_u32(map + 8) != VERSION_INDEX_FORMAT) {
+        return VERSION_INDEX_CORRUPT;
+    }
+
+    idx->count = get_u64(map + 16);
+    entries_off = get_u64(map + 24);
+    keys_off = get_u64(map + 32);
+    strings_off = get_u64(map + 40);
+    file_size = get_u64(map + 48);
+
+    if (file_size != idx->map_len ||
+        entries_off != VERSION_INDEX_HEADER_SIZE ||
+        idx->count > (file_size - entries_off) / VERSION_INDEX_ENTRY_SIZE ||
+        keys_off != entries_off + idx->count * VERSION_INDEX_ENTRY_SIZE ||
+        strings_off < keys_off || strings_off > file_size) {
+        return VERSION_INDEX_CORRUPT;
+    }
+
+    idx->entries = map + entries_off;
+    idx->keys = map + keys_off;
+    idx->strings = (const char *)map + strings_off;
+    idx->keys_len = strings_off - keys_off;
+    idx->strings_len = file_size - strings_off;
+    return VERSION_INDEX_OK;
+}
+
+/*
+ * Check the checksum and every entry of an open index, reading all of it.
+ * Lookups bounds-check what they read anyway, so a damaged index that was
+ * not verified gives wrong answers but never reads outside the mapping.
+ */
+int
+version_index_verify(const VersionIndex *idx)
+{
+    const unsigned char *entry;
+    uint32_t str_off, str_len;
+    uint64_t i;
+
+    if (checksum_update(FNV_OFFSET, idx->map + VERSION_INDEX_HEADER_SIZE, idx->map_len - VERSION_INDEX_HEADER_SIZE) != get_u64(idx->map + 56)) {
+        return VERSION_INDEX_CORRUPT;
+    }
+    for (i = 0; i < idx->count; i++) {
+        entry = idx->entries + i * VERSION_INDEX_ENTRY_SIZE;
+        str_off = get_u32(entry + 8);
+        str_len = get_u32(entry + 12);
+        if ((uint64_t)get_u32(entry) + get_u32(entry + 4) > idx->keys_len ||
+            (uint64_t)str_off + str_len >= idx->strings_len ||
+            idx->strings[str_off + str_len] != '\0') {
+            return VERSION_INDEX_CORRUPT;
+        }
+    }
+    return VERSION_INDEX_OK;
+}
+
+int
+version_index_open(VersionIndex *idx, const char *path)
+{
+    struct stat st;
+    void *map;
+    int fd, status, saved_errno;
+
+    memset(idx, 0, sizeof(VersionIndex));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return VERSION_INDEX_ERRNO;
+    }
+    if (fstat(fd, &st) != 0) {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return VERSION_INDEX_ERRNO;
+    }
+    if ((size_t)st.st_size < VERSION_INDEX_HEADER_SIZE) {
+        close(fd);
+        return VERSION_INDEX_CORRUPT;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    saved_errno = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = saved_errno;
+        return VERSION_INDEX_ERRNO;
+    }
+
+    idx->map = map;
+    idx->map_len = st.st_size;
+    status = validate_index(idx);
+    if (status != VERSION_INDEX_OK) {
+        version_index_close(idx);
+    }
+    return status;
+}
+
+void
+version_index_close(VersionIndex *idx)
+{
+    if (idx->map != NULL) {
+        munmap((void *)idx->map, idx->map_len);
+    }
+    memset(idx, 0, sizeof(VersionIndex));
+}
+
+/*
+ * Returns the `i`th version in version order, NUL terminated, and stores
+ * its length in `len` when not NULL. The string lives in the mapping.
+ * Returns NULL if the entry points outside the index.
+ */
+const char *
+version_index_get(const VersionIndex *idx, size_t i, size_t *len)
+{
+    const unsigned char *entry = idx->entries + i * VERSION_INDEX_ENTRY_SIZE;
+    uint32_t str_off = get_u32(entry + 8), str_len = get_u32(entry + 12);
+
+    if ((uint64_t)str_off + str_len >= idx->strings_len || idx->strings[str_off + str_len] != '\0') {
+        return NULL;
+    }
+    if (len != NULL) {
+        *len = str_len;
+    }
+    return idx->strings + str_off;
+}
+
+/*
+ * Binary search for the first entry whose key is not below (or, with
+ * `upper`, above) the key of `version`.
+ */
+size_t
+search(const VersionIndex *idx, const char *version, size_t len, int upper)
+{
+    unsigned char stack_key[256], *key = stack_key;
+    const unsigned char *entry;
+    size_t key_len, lo = 0, hi = idx->count, mid;
+    uint32_t entry_off, entry_len;
+    int cmp;
+
+    if (VERSION_SORTER_KEY_MAX(len) > sizeof(stack_key)) {
+        key = malloc(VERSION_SORTER_KEY_MAX(len));
+        if (key == NULL) {
+            DIE("ERROR: Not enough memory to search version index")
+        }
+    }
+    key_len = version_sorter_key(version, len, key, VERSION_SORTER_KEY_MAX(len));
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        entry = idx->entries + mid * VERSION_INDEX_ENTRY_SIZE;
+        entry_off = get_u32(entry);
+        entry_len = get_u32(entry + 4);
+        if ((uint64_t)entry_off + entry_len > idx->keys_len) {
+            /* Damaged; compare it as an empty key rather than read past the end */
+            entry_off = entry_len = 0;
+        }
+        cmp = version_sorter_key_compare(idx->keys + entry_off, entry_len, key, key_len);
+        if (cmp < 0 || (upper && cmp == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (key != stack_key) {
+        free(key);
+    }
+    return lo;
+}
+
+/* Number of versions that sort strictly before `version`: its rank */
+size_t
+version_index_lower_bound(const VersionIndex *idx, const char *version, size_t len)
+{
+    return search(idx, version, len, 0);
+}
+
+/* Number of versions that sort before or together with `version` */
+size_t
+version_index_upper_bound(const VersionIndex *idx, const char *version, size_t len)
+{
+    return search(idx, version, len, 1);
+}
+
+/*
+ * Look `version` up byte for byte. Returns 1 and stores its position in
+ * `pos` when found, 0 otherwise.
+ */
+int
+version_index_find(const VersionIndex *idx, const char *version, size_t len, size_t *pos)
+{
+    size_t i, hi = version_index_upper_bound(idx, version, len), str_len;
+    const char *str;
+
+    for (i = version_index_lower_bound(idx, version, len); i < hi; i++) {
+        str = version_index_get(idx, i, &str_len);
+        if (str != NULL && str_len == len && memcmp(str, version, len) == 0) {
+            if (pos != NULL) {
+                *pos = i;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#endif /* HAVE_VERSION_INDEX */
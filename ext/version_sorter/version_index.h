@@ -0,0 +1,71 @@
+/*
+ *  version_index.h
+ *  version_sorter
+ *
+ *  A sorted set of versions persisted to disk and read back with mmap, so
+ *  a process can answer lookups straight away instead of re-sorting every
+ *  known version at startup, and worker processes share the same pages.
+ *
+ */
+
+#ifndef _VERSION_INDEX_H
+#define _VERSION_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(HAVE_SYS_MMAN_H) || defined(__unix__) || defined(__APPLE__)
+#define HAVE_VERSION_INDEX 1
+#endif
+
+/*
+ * File layout, all integers little-endian:
+ *
+ *   header   magic "VSINDEX\0", u32 format version, u32 flags (0),
+ *            u64 entry count, u64 offsets of the entry table, the key blob
+ *            and the string blob, u64 file size, u64 FNV-1a checksum of
+ *            everything after the header
+ *   entries  per version: u32 key offset, u32 key length, u32 string
+ *            offset, u32 string length, in version order
+ *   keys     the version_sorter_key of every version
+ *   strings  every version, NUL terminated
+ */
+#define VERSION_INDEX_MAGIC "VSINDEX"
+#define VERSION_INDEX_FORMAT 1
+#define VERSION_INDEX_HEADER_SIZE 64
+#define VERSION_INDEX_ENTRY_SIZE 16
+
+enum version_index_status {
+    VERSION_INDEX_OK = 0,
+    VERSION_INDEX_ERRNO = -1,   /* system call failed, see errno */
+    VERSION_INDEX_CORRUPT = -2, /* not an index, or a damaged one */
+    VERSION_INDEX_TOO_BIG = -3  /* more than the 32-bit offsets can address */
+};
+
+typedef struct _VersionIndex {
+    const unsigned char *map;
+    size_t map_len;
+    uint64_t count;
+    const unsigned char *entries;
+    const unsigned char *keys;
+    const char *strings;
+    uint64_t keys_len;
+    uint64_t strings_len;
+} VersionIndex;
+
+extern int version_index_build(const char *, char **, size_t);
+extern int version_index_append(const char *, char **, size_t);
+extern int version_index_lock(const char *, int);
+extern void version_index_unlock(int);
+extern int version_index_build_locked(const char *, char **, size_t);
+extern int version_index_append_locked(const char *, char **, size_t);
+
+extern int version_index_open(VersionIndex *, const char *);
+extern int version_index_verify(const VersionIndex *);
+extern void version_index_close(VersionIndex *);
+extern const char* version_index_get(const VersionIndex *, size_t, size_t *);
+extern size_t version_index_lower_bound(const VersionIndex *, const char *, size_t);
+extern size_t version_index_upper_bound(const VersionIndex *, const char *, size_t);
+extern int version_index_find(const VersionIndex *, const char *, size_t, size_t *);
+
+#endif /* _VERSION_INDEX_H */
@@ -10,204 +10,745 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
 #include "version_sorter.h"
 
+#if defined(HAVE_PTHREAD_H) || defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define HAVE_THREADS 1
+#endif
 
-static VersionSortingItem * version_sorting_item_init(const char *, int);
-static void version_sorting_item_free(VersionSortingItem *);
-static void version_sorting_item_add_piece(VersionSortingItem *, char *);
-static void parse_version_word(VersionSortingItem *);
-static void create_normalized_version(VersionSortingItem *, const int);
+#define MIN_CAPA 16
+#define ARENA_BLOCK_SIZE 4096
+#define FNV32_OFFSET 2166136261U
+#define FNV32_PRIME 16777619U
+
+
+static int grow_buffer(void **, size_t *, size_t, size_t);
+static int version_sorter_context_reserve(VersionSorterContext *, size_t);
+static unsigned char * arena_alloc(VersionSorterContext *, size_t);
 static int compare_by_version(const void *, const void *);
 static enum scan_state scan_state_get(const char);
+#if HAVE_THREADS
+static void * sort_many_worker(void *);
+static void * finish_many_worker(void *);
+#endif
 
 
-VersionSortingItem *
-version_sorting_item_init(const char *original, int idx)
+/*
+ * Make sure `*buf` has room for at least `need` elements of `size` bytes,
+ * doubling the capacity as required. Returns 0 on success and -1 when
+ * the allocator fails, in which case the old buffer is left untouched.
+ */
+int
+grow_buffer(void **buf, size_t *capa, size_t need, size_t size)
 {
-    VersionSortingItem *vsi = malloc(sizeof(VersionSortingItem));
-    if (vsi == NULL) {
-        DIE("ERROR: Not enough memory to allocate VersionSortingItem")
+    size_t new_capa = *capa ? *capa : MIN_CAPA;
+    void *new_buf;
+
+    if (need <= *capa) {
+        return 0;
+    }
+    while (new_capa < need) {
+        new_capa *= 2;
     }
-    vsi->head = NULL;
-    vsi->tail = NULL;
-    vsi->node_len = 0;
-    vsi->widest_len = 0;
-    vsi->original = original;
-    vsi->original_len = strlen(original);
-    vsi->original_idx = idx;
-    vsi->normalized = NULL;
-    parse_version_word(vsi);
+    new_buf = realloc(*buf, new_capa * size);
+    if (new_buf == NULL) {
+        return -1;
+    }
+    *buf = new_buf;
+    *capa = new_capa;
+    return 0;
+}
 
-    return vsi;
+VersionSorterContext *
+version_sorter_context_new(void)
+{
+    VersionSorterContext *ctx = calloc(1, sizeof(VersionSorterContext));
+    if (ctx == NULL) {
+        DIE("ERROR: Not enough memory to allocate VersionSorterContext")
+    }
+    return ctx;
 }
 
 void
-version_sorting_item_free(VersionSortingItem *vsi)
+version_sorter_context_shrink(VersionSorterContext *ctx)
 {
-    VersionPiece *cur;
-    while (cur = vsi->head) {
-        vsi->head = cur->next;
-        free(cur->str);
-        free(cur);
-    }
-    if (vsi->normalized != NULL) {
-      free(vsi->normalized);
+    VersionArenaBlock *block;
+
+    while ((block = ctx->arena) != NULL) {
+        ctx->arena = block->next;
+        free(block);
     }
-    free(vsi);
+    free(ctx->items);
+    free(ctx->sorting_list);
+    free(ctx->ordering);
+    free(ctx->list);
+    memset(ctx, 0, sizeof(VersionSorterContext));
 }
 
 void
-version_sorting_item_add_piece(VersionSortingItem *vsi, char *str)
+version_sorter_context_free(VersionSorterContext *ctx)
 {
-    VersionPiece *piece = malloc(sizeof(VersionPiece));
-    if (piece == NULL) {
-        DIE("ERROR: Not enough memory to allocate string linked list node")
+    version_sorter_context_shrink(ctx);
+    free(ctx);
+}
+
+int
+version_sorter_context_reserve(VersionSorterContext *ctx, size_t len)
+{
+    size_t capa = ctx->items_capa;
+
+    if (len == 0) {
+        len = 1;
+    }
+    if (len <= capa) {
+        return 0;
     }
-    piece->str = str;
-    piece->len = strlen(str);
-    piece->next = NULL;
+    /* All four arrays share one capacity; only commit it once they all grew */
+    if (grow_buffer((void **)&ctx->items, &capa, len, sizeof(VersionSortingItem)) < 0) {
+        return -1;
+    }
+    capa = ctx->items_capa;
+    if (grow_buffer((void **)&ctx->sorting_list, &capa, len, sizeof(VersionSortingItem *)) < 0) {
+        return -1;
+    }
+    capa = ctx->items_capa;
+    if (grow_buffer((void **)&ctx->ordering, &capa, len, sizeof(int)) < 0) {
+        return -1;
+    }
+    capa = ctx->items_capa;
+    if (grow_buffer((void **)&ctx->list, &capa, len, sizeof(char *)) < 0) {
+        return -1;
+    }
+    ctx->items_capa = capa;
+    return 0;
+}
 
-    if (vsi->head == NULL) {
-        vsi->head = piece;
-        vsi->tail = piece;
-    } else {
-        vsi->tail->next = piece;
-        vsi->tail = piece;
+/*
+ * Hand out `size` bytes from the arena. Blocks kept from earlier sorts are
+ * reused first; when they run out a new block, twice as big as the last
+ * one, is chained at the end.
+ */
+unsigned char *
+arena_alloc(VersionSorterContext *ctx, size_t size)
+{
+    VersionArenaBlock *block = ctx->arena_cur, *last = NULL;
+    size_t capa = ARENA_BLOCK_SIZE;
+    unsigned char *ptr;
+
+    while (block != NULL && block->capa - block->used < size) {
+        last = block;
+        capa = block->capa * 2;
+        if ((block = block->next) != NULL) {
+            block->used = 0;
+        }
     }
-    vsi->node_len++;
-    if (piece->len > vsi->widest_len) {
-        vsi->widest_len = piece->len;
+    if (block == NULL) {
+        while (capa < size) {
+            capa *= 2;
+        }
+        block = malloc(sizeof(VersionArenaBlock) + capa);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = NULL;
+        block->capa = capa;
+        block->used = 0;
+        if (last != NULL) {
+            last->next = block;
+        } else {
+            ctx->arena = block;
+        }
     }
+
+    ctx->arena_cur = block;
+    ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
 }
 
+/*
+ * Returns a scratch array with room for `len` strings, owned by the
+ * context and valid until its next sort. Handy for callers that have to
+ * build a `char **` before sorting and want to avoid allocating it.
+ */
+char **
+version_sorter_context_list(VersionSorterContext *ctx, size_t len)
+{
+    if (version_sorter_context_reserve(ctx, len) < 0) {
+        return NULL;
+    }
+    return ctx->list;
+}
+
+/*
+ * Only ASCII digits and letters start runs, whatever the locale, so keys
+ * are the same everywhere and match version_sorter.hpp. Any other byte,
+ * including those of multibyte characters, only separates runs.
+ */
 enum scan_state
 scan_state_get(const char c)
 {
-    if (isdigit(c)) {
+    if (c >= '0' && c <= '9') {
         return digit;
-    } else if (isalpha(c)) {
+    } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
         return alpha;
     } else {
         return other;
     }
+}
+
+/*
+ * Start a sort of `len` items, to be filled in with
+ * version_sorter_context_add or version_sorter_context_add_key and sorted
+ * with version_sorter_context_finish. Returns -1 if memory runs out.
+ */
+int
+version_sorter_context_begin(VersionSorterContext *ctx, size_t len)
+{
+    if (version_sorter_context_reserve(ctx, len) < 0) {
+        return -1;
+    }
+    ctx->arena_cur = ctx->arena;
+    if (ctx->arena != NULL) {
+        ctx->arena->used = 0;
+    }
+    return 0;
+}
 
+/* Make item `i` the version in the `len` bytes at `str` */
+int
+version_sorter_context_add(VersionSorterContext *ctx, size_t i, const char *str, size_t len)
+{
+    VersionSortingItem *vsi = &ctx->items[i];
+    unsigned char *key = arena_alloc(ctx, VERSION_SORTER_KEY_MAX(len));
+
+    if (key == NULL) {
+        return -1;
+    }
+    vsi->key = key;
+    vsi->key_len = version_sorter_key(str, len, key, VERSION_SORTER_KEY_MAX(len));
+    vsi->original = str;
+    vsi->original_idx = (int)i;
+
+    /* Give back what the key did not use; it is the last thing allocated */
+    ctx->arena_cur->used -= VERSION_SORTER_KEY_MAX(len) - vsi->key_len;
+    return 0;
 }
 
+/*
+ * Make item `i` a version whose key was built beforehand, which the
+ * context uses as is. The key must outlive the sort.
+ */
 void
-parse_version_word(VersionSortingItem *vsi)
+version_sorter_context_add_key(VersionSorterContext *ctx, size_t i, const unsigned char *key, size_t key_len)
 {
-    int start = 0, end = 0, size = 0;
-    char current_char, next_char;
-    char *part;
-    enum scan_state current_state, next_state;
+    VersionSortingItem *vsi = &ctx->items[i];
 
-    while ((current_char = vsi->original[start]) != '\0') {
-        current_state = scan_state_get(current_char);
+    vsi->key = key;
+    vsi->key_len = key_len;
+    vsi->original = NULL;
+    vsi->original_idx = (int)i;
+}
 
-        if (current_state == other) {
-            start++;
-            end = start;
-            continue;
+/* Ties keep their original order, so sorting is stable */
+int
+compare_by_version(const void *a, const void *b)
+{
+    const VersionSortingItem *ia = *(const VersionSortingItem **)a, *ib = *(const VersionSortingItem **)b;
+    int cmp = version_sorter_key_compare(ia->key, ia->key_len, ib->key, ib->key_len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return ia->original_idx - ib->original_idx;
+}
+
+/*
+ * Sort the `len` items added since version_sorter_context_begin. Returns
+ * the original index of every sorted item; the array belongs to the
+ * context and stays valid until its next sort.
+ */
+int*
+version_sorter_context_finish(VersionSorterContext *ctx, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        ctx->sorting_list[i] = &ctx->items[i];
+    }
+
+    qsort((void *) ctx->sorting_list, len, sizeof(VersionSortingItem *), &compare_by_version);
+
+    for (i = 0; i < len; i++) {
+        ctx->ordering[i] = ctx->sorting_list[i]->original_idx;
+    }
+    return ctx->ordering;
+}
+
+/*
+ * Of the `len` items added since version_sorter_context_begin, keep only
+ * the newest of every release line, that is of every group of versions
+ * whose first `depth` runs are the same ("3.1.4" and "3.1.9" share the
+ * line 3.1 at a depth of 2; "3" is a line of its own). Among equal
+ * versions the first one added wins. Stores the number of winners in
+ * `count` and returns their original indexes in sorted order, in an array
+ * that belongs to the context like the one of version_sorter_context_finish.
+ * Returns NULL if memory runs out.
+ *
+ * Lines are found in one pass with an open addressing table over the key
+ * prefixes, which lives in the arena, so only the winners get sorted.
+ */
+int*
+version_sorter_context_latest_per_line(VersionSorterContext *ctx, size_t len, size_t depth, size_t *count)
+{
+    VersionSortingItem *vsi, **table, **slot;
+    unsigned char *raw;
+    size_t mask = MIN_CAPA - 1, prefix_len, winners = 0, i, j;
+    unsigned int hash;
+
+    while (mask < len * 2) {
+        mask = mask * 2 + 1;
+    }
+    /* Keys are bytes, so the arena needs padding for an array of pointers */
+    raw = arena_alloc(ctx, (mask + 1) * sizeof(VersionSortingItem *) + sizeof(void *) - 1);
+    if (raw == NULL) {
+        return NULL;
+    }
+    table = (VersionSortingItem **)(((size_t)raw + sizeof(void *) - 1) & ~(sizeof(void *) - 1));
+    memset(table, 0, (mask + 1) * sizeof(VersionSortingItem *));
+
+    for (i = 0; i < len; i++) {
+        vsi = &ctx->items[i];
+        prefix_len = version_sorter_key_prefix(vsi->key, vsi->key_len, depth);
+
+        hash = FNV32_OFFSET;
+        for (j = 0; j < prefix_len; j++) {
+            hash = (hash ^ vsi->key[j]) * FNV32_PRIME;
         }
 
-        do {
-            end++;
-            next_char = vsi->original[end];
-            next_state = scan_state_get(next_char);
-        } while (next_char != '\0' && current_state == next_state);
+        for (slot = &table[hash & mask]; *slot != NULL; slot = &table[(slot - table + 1) & mask]) {
+            if (version_sorter_key_prefix((*slot)->key, (*slot)->key_len, depth) == prefix_len &&
+                memcmp((*slot)->key, vsi->key, prefix_len) == 0) {
+                break;
+            }
+        }
+        if (*slot == NULL) {
+            *slot = vsi;
+            winners++;
+        } else if (version_sorter_key_compare(vsi->key, vsi->key_len, (*slot)->key, (*slot)->key_len) > 0) {
+            *slot = vsi;
+        }
+    }
+
+    for (i = 0, j = 0; i <= mask; i++) {
+        if (table[i] != NULL) {
+            ctx->sorting_list[j++] = table[i];
+        }
+    }
+
+    qsort((void *) ctx->sorting_list, winners, sizeof(VersionSortingItem *), &compare_by_version);
 
-        size = end - start;
+    for (i = 0; i < winners; i++) {
+        ctx->ordering[i] = ctx->sorting_list[i]->original_idx;
+    }
+    *count = winners;
+    return ctx->ordering;
+}
+
+/*
+ * Sort `list` in place using the scratch buffers of `ctx`. Returns the
+ * original index of every sorted entry; the array belongs to the context
+ * and stays valid until its next sort. Returns NULL if memory runs out,
+ * leaving `list` untouched and the context still usable.
+ */
+int*
+version_sorter_context_sort(VersionSorterContext *ctx, char **list, size_t list_len)
+{
+    size_t i;
+    int *ordering;
 
-        part = malloc((size+1) * sizeof(char));
-        if (part == NULL) {
-            DIE("ERROR: Not enough memory to allocate word")
+    if (version_sorter_context_begin(ctx, list_len) < 0) {
+        return NULL;
+    }
+    for (i = 0; i < list_len; i++) {
+        if (version_sorter_context_add(ctx, i, list[i], strlen(list[i])) < 0) {
+            return NULL;
         }
+    }
 
-        memcpy(part, vsi->original+start, size);
-        part[size] = '\0';
+    ordering = version_sorter_context_finish(ctx, list_len);
+    for (i = 0; i < list_len; i++) {
+        list[i] = (char *) ctx->sorting_list[i]->original;
+    }
+    return ordering;
+}
 
-        version_sorting_item_add_piece(vsi, part);
+int*
+version_sorter_sort(char **list, size_t list_len)
+{
+    VersionSorterContext ctx;
+    int *ordering;
 
-        start = end;
+    memset(&ctx, 0, sizeof(VersionSorterContext));
+    if (version_sorter_context_sort(&ctx, list, list_len) == NULL) {
+        version_sorter_context_shrink(&ctx);
+        DIE("ERROR: Not enough memory to sort versions")
     }
+
+    /* Hand the ordering over to the caller, who is expected to free it */
+    ordering = ctx.ordering;
+    ctx.ordering = NULL;
+    version_sorter_context_shrink(&ctx);
+
+    return ordering;
 }
 
-void
-create_normalized_version(VersionSortingItem *vsi, const int widest_len)
+/*
+ * Sort `count` independent lists with a single context, so the buffers are
+ * set up once for the whole batch. Each list is sorted in place and the
+ * original indexes of its entries are written to the matching `orderings`
+ * array, which must have room for `lens[k]` ints. Returns 0 on success and
+ * -1 if memory runs out.
+ */
+int
+version_sorter_context_sort_many(VersionSorterContext *ctx, char **lists[], const size_t lens[], int *orderings[], size_t count)
 {
-    VersionPiece *cur;
-    int pos, i;
+    size_t k;
+    int *ordering;
 
-    char *result = malloc(((vsi->node_len * widest_len) + 1) * sizeof(char));
-    if (result == NULL) {
-        DIE("ERROR: Unable to allocate memory")
+    for (k = 0; k < count; k++) {
+        ordering = version_sorter_context_sort(ctx, lists[k], lens[k]);
+        if (ordering == NULL) {
+            return -1;
+        }
+        memcpy(orderings[k], ordering, lens[k] * sizeof(int));
     }
-    result[0] = '\0';
-    pos = 0;
+    return 0;
+}
 
-    for (cur = vsi->head; cur; cur = cur->next) {
+#if HAVE_THREADS
+typedef struct _SortManyJob {
+    char ***lists;
+    const size_t *lens;
+    int **orderings;
+    size_t count;
+    size_t first;
+    size_t stride;
+    int status;
+} SortManyJob;
+
+void *
+sort_many_worker(void *arg)
+{
+    SortManyJob *job = arg;
+    VersionSorterContext ctx;
+    size_t k;
+
+    memset(&ctx, 0, sizeof(VersionSorterContext));
+    job->status = 0;
+    for (k = job->first; k < job->count; k += job->stride) {
+        if (version_sorter_context_sort_many(&ctx, job->lists + k, job->lens + k, job->orderings + k, 1) < 0) {
+            job->status = -1;
+            break;
+        }
+    }
+    version_sorter_context_shrink(&ctx);
+    return NULL;
+}
+#endif
 
-        /* Left-Pad digits with a space */
-        if (cur->len < widest_len && isdigit(cur->str[0])) {
-            for (i = 0; i < widest_len - cur->len; i++) {
-                result[pos] = ' ';
-                pos++;
+/*
+ * Same as version_sorter_context_sort_many, spreading the lists over up to
+ * `threads` workers with a context each. Falls back to the calling thread
+ * when threads are unavailable or not worth it.
+ */
+int
+version_sorter_sort_many(char **lists[], const size_t lens[], int *orderings[], size_t count, int threads)
+{
+    VersionSorterContext ctx;
+    int status;
+#if HAVE_THREADS
+    pthread_t tids[VERSION_SORTER_MAX_THREADS];
+    SortManyJob jobs[VERSION_SORTER_MAX_THREADS];
+    int started[VERSION_SORTER_MAX_THREADS];
+    int t;
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > VERSION_SORTER_MAX_THREADS) {
+        threads = VERSION_SORTER_MAX_THREADS;
+    }
+    if ((size_t)threads > count) {
+        threads = (int)count;
+    }
+    if (threads > 1) {
+        for (t = 0; t < threads; t++) {
+            jobs[t].lists = lists;
+            jobs[t].lens = lens;
+            jobs[t].orderings = orderings;
+            jobs[t].count = count;
+            jobs[t].first = t;
+            jobs[t].stride = threads;
+            jobs[t].status = 0;
+        }
+        /* Worker 0 runs on the calling thread, as does any that fails to start */
+        for (t = 1; t < threads; t++) {
+            started[t] = pthread_create(&tids[t], NULL, sort_many_worker, &jobs[t]) == 0;
+            if (!started[t]) {
+                sort_many_worker(&jobs[t]);
             }
-            result[pos] = '\0';
         }
-        strcat(result, cur->str);
-        pos += cur->len;
+        sort_many_worker(&jobs[0]);
 
-        /* Right-Pad words with a space */
-        if (cur->len < widest_len && isalpha(cur->str[0])) {
-            for (i = 0; i < widest_len - cur->len; i++) {
-                result[pos] = ' ';
-                pos++;
+        status = jobs[0].status;
+        for (t = 1; t < threads; t++) {
+            if (started[t]) {
+                pthread_join(tids[t], NULL);
+            }
+            if (jobs[t].status < 0) {
+                status = -1;
             }
-            result[pos] = '\0';
         }
+        return status;
     }
-    vsi->normalized = result;
-    vsi->widest_len = widest_len;
+#endif
+
+    memset(&ctx, 0, sizeof(VersionSorterContext));
+    status = version_sorter_context_sort_many(&ctx, lists, lens, orderings, count);
+    version_sorter_context_shrink(&ctx);
+    return status;
 }
 
-int
-compare_by_version(const void *a, const void *b)
+typedef struct _FinishManyJob {
+    VersionSortingItem *items;
+    const size_t *lens;
+    int **orderings;
+    size_t first;
+    size_t last;
+    size_t offset;
+} FinishManyJob;
+
+/* Same order as compare_by_version, on the items themselves */
+static int
+compare_items(const void *a, const void *b)
 {
-    return strcmp((*(const VersionSortingItem **)a)->normalized, (*(const VersionSortingItem **)b)->normalized);
+    const VersionSortingItem *ia = a, *ib = b;
+    int cmp = version_sorter_key_compare(ia->key, ia->key_len, ib->key, ib->key_len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return ia->original_idx - ib->original_idx;
 }
 
-int*
-version_sorter_sort(char **list, size_t list_len)
+static void
+finish_many_lists(FinishManyJob *job)
 {
-    int i, widest_len = 0;
-    VersionSortingItem *vsi;
-    VersionSortingItem **sorting_list = calloc(list_len, sizeof(VersionSortingItem *));
-    int *ordering = calloc(list_len, sizeof(int));
+    VersionSortingItem *items = job->items + job->offset;
+    size_t offset = job->offset, k, j;
 
-    for (i = 0; i < list_len; i++) {
-        vsi = version_sorting_item_init(list[i], i);
-        if (vsi->widest_len > widest_len) {
-            widest_len = vsi->widest_len;
+    for (k = job->first; k < job->last; k++) {
+        qsort((void *) items, job->lens[k], sizeof(VersionSortingItem), &compare_items);
+        for (j = 0; j < job->lens[k]; j++) {
+            job->orderings[k][j] = items[j].original_idx - (int)offset;
         }
-        sorting_list[i] = vsi;
+        items += job->lens[k];
+        offset += job->lens[k];
     }
+}
 
-    for (i = 0; i < list_len; i++) {
-        create_normalized_version(sorting_list[i], widest_len);
+#if HAVE_THREADS
+void *
+finish_many_worker(void *arg)
+{
+    finish_many_lists(arg);
+    return NULL;
+}
+#endif
+
+/*
+ * Sort `count` lists whose items were all added to `ctx` one after the
+ * other since version_sorter_context_begin, list k taking the next
+ * `lens[k]` items with their index in the whole batch. The original
+ * indexes of every list, relative to its first item, are written to the
+ * matching `orderings` array. The lists are spread over up to `threads`
+ * workers in runs of about the same number of items.
+ *
+ * Nothing is allocated and no key is built, so this cannot fail, and it
+ * may run while the caller holds no lock on the strings the keys came
+ * from. The items are sorted in place.
+ */
+void
+version_sorter_context_finish_many(VersionSorterContext *ctx, const size_t lens[], int *orderings[], size_t count, int threads)
+{
+    FinishManyJob jobs[VERSION_SORTER_MAX_THREADS];
+    size_t total = 0, offset = 0, target, k = 0;
+    int t;
+#if HAVE_THREADS
+    pthread_t tids[VERSION_SORTER_MAX_THREADS];
+    int started[VERSION_SORTER_MAX_THREADS];
+#endif
+
+    for (k = 0; k < count; k++) {
+        total += lens[k];
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > VERSION_SORTER_MAX_THREADS) {
+        threads = VERSION_SORTER_MAX_THREADS;
+    }
+    if ((size_t)threads > count) {
+        threads = count ? (int)count : 1;
+    }
+#if !HAVE_THREADS
+    threads = 1;
+#endif
+
+    k = 0;
+    for (t = 0; t < threads; t++) {
+        target = total / threads * (t + 1) + total % threads * (t + 1) / threads;
+        jobs[t].items = ctx->items;
+        jobs[t].lens = lens;
+        jobs[t].orderings = orderings;
+        jobs[t].first = k;
+        jobs[t].offset = offset;
+        while (k < count && (offset < target || t == threads - 1)) {
+            offset += lens[k++];
+        }
+        jobs[t].last = k;
     }
 
-    qsort((void *) sorting_list, list_len, sizeof(VersionSortingItem *), &compare_by_version);
+#if HAVE_THREADS
+    /* Worker 0 runs on the calling thread, as does any that fails to start */
+    for (t = 1; t < threads; t++) {
+        started[t] = pthread_create(&tids[t], NULL, finish_many_worker, &jobs[t]) == 0;
+        if (!started[t]) {
+            finish_many_lists(&jobs[t]);
+        }
+    }
+    finish_many_lists(&jobs[0]);
+    for (t = 1; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        }
+    }
+#else
+    finish_many_lists(&jobs[0]);
+#endif
+}
 
-    for (i = 0; i < list_len; i++) {
-        vsi = sorting_list[i];
-        list[i] = (char *) vsi->original;
-        ordering[i] = vsi->original_idx;
-        version_sorting_item_free(vsi);
+/*
+ * Write the binary key of the `len` bytes at `str` into `key`, which has
+ * room for `key_size` bytes, and return the full length of the key. Keys
+ * compare bytewise, shorter first (see version_sorter_key_compare), in the
+ * same order as the sorter, so they can be built once and compared or
+ * stored many times. VERSION_SORTER_KEY_MAX(len) bytes are always enough.
+ *
+ * Every digit run is written as 0x01, its length and its digits, and every
+ * letter run as 0x02, its letters and a 0x00 terminator. Lengths below 255
+ * take one byte; longer ones are 0xFF followed by four big-endian bytes.
+ * version_sorter.hpp produces the very same keys.
+ */
+size_t
+version_sorter_key(const char *str, size_t len, unsigned char *key, size_t key_size)
+{
+    size_t start = 0, end, run, pos = 0;
+    enum scan_state state;
+
+#define PUT(c) do { if (pos < key_size) { key[pos] = (unsigned char)(c); } pos++; } while (0)
+
+    while (start < len) {
+        state = scan_state_get(str[start]);
+        if (state == other) {
+            start++;
+            continue;
+        }
+        for (end = start + 1; end < len && scan_state_get(str[end]) == state; end++)
+            ;
+        run = end - start;
+
+        if (state == digit) {
+            PUT(0x01);
+            if (run < 0xFF) {
+                PUT(run);
+            } else {
+                PUT(0xFF);
+                PUT((run >> 24) & 0xFF);
+                PUT((run >> 16) & 0xFF);
+                PUT((run >> 8) & 0xFF);
+                PUT(run & 0xFF);
+            }
+        } else {
+            PUT(0x02);
+        }
+        if (pos < key_size) {
+            memcpy(key + pos, str + start, run < key_size - pos ? run : key_size - pos);
+        }
+        pos += run;
+        if (state == alpha) {
+            PUT(0x00);
+        }
+        start = end;
     }
-    free(sorting_list);
 
-    return ordering;
+#undef PUT
+    return pos;
+}
+
+/*
+ * Like version_sorter_key, but the key starts with the
+ * VERSION_SORTER_KEY_FORMAT byte. These are the keys meant to leave the
+ * process: their plain bytewise order, the one databases use for binary
+ * columns, is the sorter's order, and the format byte keeps them
+ * recognizable should the encoding ever change.
+ * VERSION_SORTER_SORT_KEY_MAX(len) bytes are always enough.
+ */
+size_t
+version_sorter_sort_key(const char *str, size_t len, unsigned char *key, size_t key_size)
+{
+    if (key_size == 0) {
+        return 1 + version_sorter_key(str, len, key, 0);
+    }
+    key[0] = VERSION_SORTER_KEY_FORMAT;
+    return 1 + version_sorter_key(str, len, key + 1, key_size - 1);
+}
+
+/*
+ * Length of the part of a binary key that covers the first `runs` runs of
+ * its version; the whole key if it has fewer. Versions whose prefixes are
+ * equal agree on those runs.
+ */
+size_t
+version_sorter_key_prefix(const unsigned char *key, size_t key_len, size_t runs)
+{
+    size_t pos = 0, run;
+
+    for (; runs > 0 && pos < key_len; runs--) {
+        if (key[pos++] == 0x01) {
+            run = key[pos++];
+            if (run == 0xFF) {
+                run = ((size_t)key[pos] << 24) | ((size_t)key[pos + 1] << 16) |
+                      ((size_t)key[pos + 2] << 8) | key[pos + 3];
+                pos += 4;
+            }
+            pos += run;
+        } else {
+            while (pos < key_len && key[pos] != 0x00) {
+                pos++;
+            }
+            pos++;
+        }
+    }
+    return pos < key_len ? pos : key_len;
+}
+
+int
+version_sorter_key_compare(const unsigned char *a, size_t a_len, const unsigned char *b, size_t b_len)
+{
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (a_len > b_len) - (a_len < b_len);
 }
@@ -36,21 +36,52 @@
 #endif
 
 typedef struct _VersionSortingItem {
-    struct _VersionPiece *head;
-    struct _VersionPiece *tail;
-    int node_len;
-    int widest_len;
-    char *normalized;
+    const unsigned char *key;
+    size_t key_len;
     const char *original;
-    size_t original_len;
     int original_idx;
 } VersionSortingItem;
 
-typedef struct _VersionPiece {
-    char *str;
-    int len;
-    struct _VersionPiece *next;
-} VersionPiece;
+typedef struct _VersionArenaBlock {
+    struct _VersionArenaBlock *next;
+    size_t capa;
+    size_t used;
+    unsigned char data[1];
+} VersionArenaBlock;
+
+/*
+ * Scratch space for sorting. Every buffer a sort needs lives here and is
+ * kept between calls, growing geometrically, so that sorting lists of a
+ * similar size over and over does not touch the allocator at all. Keys
+ * go into a chain of arena blocks, which never move once allocated.
+ * Zero-initialize it (or use version_sorter_context_new) before use.
+ */
+typedef struct _VersionSorterContext {
+    VersionSortingItem *items;
+    VersionSortingItem **sorting_list;
+    int *ordering;
+    char **list;
+    size_t items_capa;
+
+    VersionArenaBlock *arena;
+    VersionArenaBlock *arena_cur;
+
+    /* Set by callers while a sort is under way, to refuse re-entry */
+    int busy;
+} VersionSorterContext;
+
+#define VERSION_SORTER_MAX_THREADS 64
+
+/* Upper bound for the size of the binary key of a `len` bytes version */
+#define VERSION_SORTER_KEY_MAX(len) (3 * (len))
+
+/*
+ * Format of the keys written by version_sorter_sort_key, stored as their
+ * first byte. It changes whenever the encoding does, so that keys kept
+ * elsewhere, say in a database column, can be told apart and rebuilt.
+ */
+#define VERSION_SORTER_KEY_FORMAT 1
+#define VERSION_SORTER_SORT_KEY_MAX(len) (VERSION_SORTER_KEY_MAX(len) + 1)
 
 enum scan_state {
     digit, alpha, other
@@ -58,4 +89,23 @@ enum scan_state {
 
 extern int* version_sorter_sort(char **, size_t);
 
+extern VersionSorterContext* version_sorter_context_new(void);
+extern void version_sorter_context_free(VersionSorterContext *);
+extern void version_sorter_context_shrink(VersionSorterContext *);
+extern char** version_sorter_context_list(VersionSorterContext *, size_t);
+extern int version_sorter_context_begin(VersionSorterContext *, size_t);
+extern int version_sorter_context_add(VersionSorterContext *, size_t, const char *, size_t);
+extern void version_sorter_context_add_key(VersionSorterContext *, size_t, const unsigned char *, size_t);
+extern int* version_sorter_context_finish(VersionSorterContext *, size_t);
+extern int* version_sorter_context_latest_per_line(VersionSorterContext *, size_t, size_t, size_t *);
+extern int* version_sorter_context_sort(VersionSorterContext *, char **, size_t);
+extern int version_sorter_context_sort_many(VersionSorterContext *, char **[], const size_t [], int *[], size_t);
+extern int version_sorter_sort_many(char **[], const size_t [], int *[], size_t, int);
+extern void version_sorter_context_finish_many(VersionSorterContext *, const size_t [], int *[], size_t, int);
+
+extern size_t version_sorter_key(const char *, size_t, unsigned char *, size_t);
+extern size_t version_sorter_sort_key(const char *, size_t, unsigned char *, size_t);
+extern size_t version_sorter_key_prefix(const unsigned char *, size_t, size_t);
+extern int version_sorter_key_compare(const unsigned char *, size_t, const unsigned char *, size_t);
+
 #endif /* _VERSION_SORTER_H */
@@ -0,0 +1,243 @@
+/*
+ *  version_sorter.hpp
+ *  version_sorter
+ *
+ *  Header-only C++17 interface to the version ordering, for sorting your
+ *  own records in place instead of going through version_sorter_sort's
+ *  `char **` and the ordering it returns.
+ *
+ *      std::vector<Release> releases = ...;
+ *      version_sorter::version_sort(releases.begin(), releases.end(), &Release::tag);
+ *
+ *  The ordering is exactly the one of version_sorter_sort: a version is
+ *  split into runs of digits and runs of letters (anything else only
+ *  separates runs), and versions are compared run by run. Digit runs sort
+ *  before letter runs, digit runs compare by length and then by value,
+ *  letter runs compare bytewise, and a version that runs out of runs first
+ *  sorts first.
+ *
+ */
+
+#ifndef _VERSION_SORTER_HPP
+#define _VERSION_SORTER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace version_sorter {
+
+enum class scan_state { digit, alpha, other };
+
+constexpr scan_state
+scan_state_get(char c) noexcept
+{
+    if (c >= '0' && c <= '9') {
+        return scan_state::digit;
+    } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+        return scan_state::alpha;
+    } else {
+        return scan_state::other;
+    }
+}
+
+struct version_piece {
+    std::string_view str;
+    scan_state state;
+};
+
+/*
+ * Yields the digit and letter runs of a version one at a time, without
+ * copying or allocating.
+ */
+class piece_scanner {
+public:
+    constexpr explicit piece_scanner(std::string_view version) noexcept
+        : version_(version), pos_(0) {}
+
+    constexpr bool
+    next(version_piece &piece) noexcept
+    {
+        std::size_t start = 0;
+        scan_state state = scan_state::other;
+
+        while (pos_ < version_.size() && (state = scan_state_get(version_[pos_])) == scan_state::other) {
+            pos_++;
+        }
+        if (pos_ == version_.size()) {
+            return false;
+        }
+        start = pos_;
+        while (pos_ < version_.size() && scan_state_get(version_[pos_]) == state) {
+            pos_++;
+        }
+        piece.str = version_.substr(start, pos_ - start);
+        piece.state = state;
+        return true;
+    }
+
+private:
+    std::string_view version_;
+    std::size_t pos_;
+};
+
+constexpr int
+compare_pieces(const version_piece &a, const version_piece &b) noexcept
+{
+    if (a.state != b.state) {
+        return a.state == scan_state::digit ? -1 : 1;
+    }
+    if (a.state == scan_state::digit && a.str.size() != b.str.size()) {
+        return a.str.size() < b.str.size() ? -1 : 1;
+    }
+    return a.str.compare(b.str);
+}
+
+/*
+ * Three-way comparison of two versions: negative, zero or positive as `a`
+ * sorts before, together with or after `b`.
+ */
+constexpr int
+version_compare(std::string_view a, std::string_view b) noexcept
+{
+    piece_scanner sa(a), sb(b);
+    version_piece pa{}, pb{};
+    bool has_a = false, has_b = false;
+    int cmp = 0;
+
+    for (;;) {
+        has_a = sa.next(pa);
+        has_b = sb.next(pb);
+        if (!has_a || !has_b) {
+            return has_a ? 1 : (has_b ? -1 : 0);
+        }
+        if ((cmp = compare_pieces(pa, pb)) != 0) {
+            return cmp;
+        }
+    }
+}
+
+/*
+ * Transparent comparator over anything convertible to std::string_view,
+ * for std::sort, std::map, std::lower_bound and friends.
+ */
+struct version_less {
+    using is_transparent = void;
+
+    template <class A, class B>
+    constexpr bool
+    operator()(const A &a, const B &b) const noexcept
+    {
+        return version_compare(std::string_view(a), std::string_view(b)) < 0;
+    }
+};
+
+/* C++17 has no std::identity yet */
+struct identity {
+    template <class T>
+    constexpr T &&
+    operator()(T &&t) const noexcept
+    {
+        return std::forward<T>(t);
+    }
+};
+
+/*
+ * Appends the binary sort key of `version` to `out`. Keys compare bytewise
+ * (memcmp, std::string::compare, a database BLOB column) in the same order
+ * as version_compare, so they can be built once and compared many times.
+ *
+ * Every digit run is written as 0x01, its length and its digits, and every
+ * letter run as 0x02, its letters and a 0x00 terminator. Lengths below 255
+ * take one byte; longer ones are 0xFF followed by four big-endian bytes.
+ */
+template <class OutputIt>
+OutputIt
+version_key(std::string_view version, OutputIt out)
+{
+    piece_scanner scanner(version);
+    version_piece piece{};
+    std::size_t len;
+
+    while (scanner.next(piece)) {
+        if (piece.state == scan_state::digit) {
+            len = piece.str.size();
+            *out++ = '\x01';
+            if (len < 0xFF) {
+                *out++ = static_cast<char>(len);
+            } else {
+                *out++ = '\xFF';
+                *out++ = static_cast<char>((len >> 24) & 0xFF);
+                *out++ = static_cast<char>((len >> 16) & 0xFF);
+                *out++ = static_cast<char>((len >> 8) & 0xFF);
+                *out++ = static_cast<char>(len & 0xFF);
+            }
+            out = std::copy(piece.str.begin(), piece.str.end(), out);
+        } else {
+            *out++ = '\x02';
+            out = std::copy(piece.str.begin(), piece.str.end(), out);
+            *out++ = '\x00';
+        }
+    }
+    return out;
+}
+
+inline std::string
+version_key(std::string_view version)
+{
+    std::string key;
+    key.reserve(version.size() + 8);
+    version_key(version, std::back_inserter(key));
+    return key;
+}
+
+/* Matches VERSION_SORTER_KEY_FORMAT in version_sorter.h */
+inline constexpr unsigned char key_format = 1;
+
+/*
+ * version_key behind a key_format byte, byte for byte what
+ * version_sorter_sort_key writes: the key to store outside the process.
+ */
+inline std::string
+sort_key(std::string_view version)
+{
+    std::string key;
+    key.reserve(version.size() + 9);
+    key.push_back(static_cast<char>(key_format));
+    version_key(version, std::back_inserter(key));
+    return key;
+}
+
+/*
+ * Sorts [first, last) by the version `proj` projects out of each element,
+ * in place. `proj` may be anything std::invoke accepts, such as a member
+ * pointer, and must yield something convertible to std::string_view.
+ * Like version_sorter_sort it is stable: versions that sort together,
+ * such as "1.0" and "1-0", keep their order.
+ */
+template <class RandomIt, class Proj = identity>
+void
+version_sort(RandomIt first, RandomIt last, Proj proj = {})
+{
+    std::stable_sort(first, last, [&proj](const auto &a, const auto &b) {
+        return version_compare(std::string_view(std::invoke(proj, a)),
+                               std::string_view(std::invoke(proj, b))) < 0;
+    });
+}
+
+template <class Range, class Proj = identity,
+          class = decltype(std::begin(std::declval<Range &>()))>
+void
+version_sort(Range &&range, Proj proj = {})
+{
+    version_sort(std::begin(range), std::end(range), std::move(proj));
+}
+
+} /* namespace version_sorter */
+
+#endif /* _VERSION_SORTER_HPP */
@@ -1,3 +1,3 @@
 module VersionSorter
-  Version = '1.1.1'
+  VERSION = '2.0.0'
 end
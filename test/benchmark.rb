@@ -0,0 +1,199 @@
+# Benchmarks the Ruby API end to end against the usual pure Ruby ways of
+# sorting versions. Run it with `rake bench`.
+#
+# For every corpus and size it reports iterations per second with a 95%
+# confidence interval, objects allocated per iteration, GC runs per 1000
+# iterations and the process RSS once the case is done.
+#
+# Environment knobs:
+#   BENCH_TIME     seconds spent measuring each case (default 2)
+#   BENCH_SAMPLES  samples the time is split into (default 10)
+#   BENCH_SIZES    comma separated list sizes (default 100,1000,10000)
+#   BENCH_FILTER   only run cases whose name matches this regexp
+$LOAD_PATH.unshift File.dirname(__FILE__) + '/../lib'
+require 'version_sorter'
+require 'rubygems'
+require 'tmpdir'
+require 'fileutils'
+
+module VersionSorterBenchmark
+  TIME = Float(ENV['BENCH_TIME'] || 2)
+  SAMPLES = Integer(ENV['BENCH_SAMPLES'] || 10)
+  SIZES = (ENV['BENCH_SIZES'] || '100,1000,10000').split(',').map { |s| Integer(s) }
+  FILTER = ENV['BENCH_FILTER'] && Regexp.new(ENV['BENCH_FILTER'])
+
+  # Two-sided 95% Student t quantiles by degrees of freedom
+  T_95 = [nil, 12.71, 4.30, 3.18, 2.78, 2.57, 2.45, 2.36, 2.31, 2.26, 2.23,
+          2.20, 2.18, 2.16, 2.14, 2.13, 2.12, 2.11, 2.10, 2.09, 2.09]
+
+  module_function
+
+  def corpora
+    rng = Random.new(1234)
+    tags = IO.read(File.dirname(__FILE__) + '/tags.txt').split("\n")
+    semver = Array.new(20_000) do
+      v = "#{rng.rand(10)}.#{rng.rand(30)}.#{rng.rand(100)}"
+      rng.rand(5).zero? ? "#{v}.#{%w(alpha beta rc pre).sample(random: rng)}#{rng.rand(5)}" : v
+    end
+    git_tags = Array.new(20_000) do
+      "v#{rng.rand(5)}.#{rng.rand(20)}.#{rng.rand(50)}#{['', '-rc1', '-beta2', '.1'].sample(random: rng)}"
+    end
+
+    { 'tags.txt' => tags, 'semver' => semver, 'git tags' => git_tags }
+  end
+
+  def sized(list, size)
+    rng = Random.new(size)
+    Array.new(size) { list.sample(random: rng) }
+  end
+
+  # Case name => lambda building the callable from a list, or nil when the
+  # case does not apply to that list.
+  def cases
+    {
+      'VersionSorter.sort' => ->(list) { -> { VersionSorter.sort(list) } },
+      'VersionSorter.rsort' => ->(list) { -> { VersionSorter.rsort(list) } },
+      'Sorter#sort' => ->(list) {
+        sorter = VersionSorter::Sorter.new
+        -> { sorter.sort(list) }
+      },
+      'sort_many (10 lists)' => ->(list) {
+        lists = list.each_slice((list.size / 10.0).ceil).to_a
+        -> { VersionSorter.sort_many(lists) }
+      },
+      'sort of Version objects' => ->(list) {
+        versions = list.map { |v| VersionSorter::Version.new(v) }
+        -> { VersionSorter.sort(versions) }
+      },
+      'Version#<=> via Array#sort' => ->(list) {
+        versions = list.map { |v| VersionSorter::Version.new(v) }
+        -> { versions.sort }
+      },
+      'latest_per_line' => ->(list) { -> { VersionSorter.latest_per_line(list) } },
+      'rsort + group_by in Ruby' => ->(list) {
+        -> { VersionSorter.rsort(list).group_by { |v| v.scan(/\d+|[a-zA-Z]+/).first(2) }.map { |_, vs| vs.first }.reverse }
+      },
+      'sort_lines' => ->(list) {
+        blob = list.join("\n") + "\n"
+        -> { VersionSorter.sort_lines(blob) }
+      },
+      'split + sort + join' => ->(list) {
+        blob = list.join("\n") + "\n"
+        -> { VersionSorter.sort(blob.split("\n")).join("\n") << "\n" }
+      },
+      'sort_by { sort_key }' => ->(list) {
+        -> { list.sort_by { |v| VersionSorter.sort_key(v) } }
+      },
+      # The usual quick fix; it gets letters wrong, but it is what gets written
+      "sort_by { split('.') }" => ->(list) {
+        -> { list.sort_by { |v| v.split('.').map(&:to_i) } }
+      },
+      'sort_by { scan }' => ->(list) {
+        -> { list.sort_by { |v| v.scan(/\d+|[a-z]+/i).map { |p| p =~ /\A\d/ ? [0, p.to_i] : [1, p] } } }
+      },
+      'Index.new + latest(10)' => ->(list) {
+        next unless defined?(VersionSorter::Index)
+        path = index_for(list)
+        # Closed right away, or the mappings pile up until the next GC
+        -> { index = VersionSorter::Index.new(path); index.latest(10).tap { index.close } }
+      },
+      'rsort + first(10)' => ->(list) {
+        -> { VersionSorter.rsort(list).first(10) }
+      },
+      'Index#range' => ->(list) {
+        next unless defined?(VersionSorter::Index)
+        index = VersionSorter::Index.new(index_for(list))
+        from, to = range_bounds(list)
+        -> { index.range(from, to) }
+      },
+      'sort + select range' => ->(list) {
+        from, to = range_bounds(list).map { |v| VersionSorter::Version.new(v) }
+        -> { VersionSorter.sort(list).select { |v| v >= from && v <= to } }
+      },
+      'sort_by { Gem::Version }' => ->(list) {
+        next unless list.all? { |v| Gem::Version.correct?(v) }
+        -> { list.sort_by { |v| Gem::Version.new(v) } }
+      },
+      'Gem::Version objects' => ->(list) {
+        next unless list.all? { |v| Gem::Version.correct?(v) }
+        versions = list.map { |v| Gem::Version.new(v) }
+        -> { versions.sort }
+      },
+    }
+  end
+
+  # Builds an index of `list` once, in a directory removed at exit
+  def index_for(list)
+    @index_dir ||= Dir.mktmpdir('version_sorter_bench').tap do |dir|
+      at_exit { FileUtils.remove_entry(dir) }
+    end
+    path = File.join(@index_dir, "#{list.hash}.idx")
+    VersionSorter::Index.build(path, list) unless File.exist?(path)
+    path
+  end
+
+  # The middle half of `list`, by version
+  def range_bounds(list)
+    sorted = VersionSorter.sort(list)
+    [sorted[sorted.size / 4], sorted[sorted.size * 3 / 4]]
+  end
+
+  def rss_kb
+    File.read('/proc/self/status')[/^VmRSS:\s+(\d+)/, 1].to_i
+  rescue SystemCallError
+    `ps -o rss= -p #{Process.pid}`.to_i
+  end
+
+  def allocations(&block)
+    block.call
+    before = GC.stat(:total_allocated_objects)
+    block.call
+    GC.stat(:total_allocated_objects) - before
+  end
+
+  def measure(&block)
+    slice = TIME / SAMPLES
+    iterations = 0
+    block.call
+    gc_before = GC.count
+
+    rates = Array.new(SAMPLES) do
+      n = 0
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      finish = start + slice
+      begin
+        block.call
+        n += 1
+      end while (now = Process.clock_gettime(Process::CLOCK_MONOTONIC)) < finish
+      iterations += n
+      n / (now - start)
+    end
+
+    mean = rates.sum / rates.size
+    sd = Math.sqrt(rates.sum { |r| (r - mean) ** 2 } / [rates.size - 1, 1].max)
+    margin = (T_95[rates.size - 1] || 1.96) * sd / Math.sqrt(rates.size)
+    [mean, margin, (GC.count - gc_before) * 1000.0 / iterations]
+  end
+
+  def run
+    puts "ruby #{RUBY_VERSION}, #{TIME}s per case in #{SAMPLES} samples"
+    corpora.each do |corpus, versions|
+      SIZES.each do |size|
+        list = sized(versions, size)
+        puts
+        puts "#{corpus}, #{size} versions"
+        printf "  %-28s %14s %9s %12s %10s %10s\n", '', 'i/s', '+/-', 'objs/iter', 'GC/1k it', 'RSS (MB)'
+
+        cases.each do |name, setup|
+          next if FILTER && name !~ FILTER
+          callable = setup.call(list) or next
+          mean, margin, gcs = measure(&callable)
+          printf "  %-28s %14.1f %8.1f%% %12d %10.2f %10.1f\n",
+            name, mean, margin * 100 / mean, allocations(&callable), gcs, rss_kb / 1024.0
+        end
+      end
+    end
+  end
+end
+
+VersionSorterBenchmark.run if $0 == __FILE__
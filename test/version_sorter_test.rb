@@ -1,4 +1,6 @@
 require 'test/unit'
+require 'tmpdir'
+require 'set'
 $LOAD_PATH.unshift File.dirname(__FILE__) + '/../lib'
 require 'version_sorter'
 
@@ -25,13 +27,316 @@ class VersionSorterTest < Test::Unit::TestCase
 
     assert_equal sorted_versions, rsort(versions)
   end
-end
 
-require 'benchmark'
-versions = IO.read(File.dirname(__FILE__) + '/tags.txt').split("\n")
-count = 10
-Benchmark.bm(20) do |x|
-  x.report("sort")             { count.times { VersionSorter.sort(versions) } }
-  x.report("rsot")             { count.times { VersionSorter.rsort(versions) } }
+  def test_version_objects
+    a, b = VersionSorter::Version.new("1.0.9"), VersionSorter::Version.new("1.0.10")
+
+    assert a < b
+    assert_equal 1, b <=> "1.0.9a"
+    assert_equal "1.0.9", a.to_s
+    assert a.frozen?
+    assert a.eql?(VersionSorter::Version.new("1-0-9"))
+    assert_equal 2, Set.new([a, b, VersionSorter::Version.new("1.0.9")]).size
+  end
+
+  def test_sorts_version_objects
+    versions = %w(1.0.9 1.0.10 2.0 3.1.4.2 1.0.9a).map { |v| VersionSorter::Version.new(v) }
+    versions << "1.0.9b"
+
+    assert_equal %w( 1.0.9 1.0.9a 1.0.9b 1.0.10 2.0 3.1.4.2 ), sort(versions).map(&:to_s)
+    assert_same versions[0], sort(versions)[0]
+  end
+
+  def test_sort_many_version_objects
+    lists = [%w( 2.0 1.0.10 ).map { |v| VersionSorter::Version.new(v) } << "1.0.9", %w( 1.10 1.9 )]
+    expected = [%w( 1.0.9 1.0.10 2.0 ), %w( 1.9 1.10 )]
+
+    assert_equal expected, sort_many(lists).map { |list| list.map(&:to_s) }
+    assert_equal expected, sort_many(lists, threads: 2).map { |list| list.map(&:to_s) }
+    assert_equal expected, VersionSorter::Sorter.new.sort_many(lists).map { |list| list.map(&:to_s) }
+    assert_same lists[0][1], sort_many(lists, threads: 2)[0][1]
+  end
+
+  def test_version_copies_and_marshal
+    version = VersionSorter::Version.new("1.0.9a")
+
+    assert_same version, version.dup
+    assert_same version, version.clone
+    assert_same version, version.clone(freeze: true)
+    assert_raise(ArgumentError) { version.clone(freeze: false) }
+
+    loaded = Marshal.load(Marshal.dump([version, version]))
+    assert_equal version, loaded[0]
+    assert version.eql?(loaded[0])
+    assert_same loaded[0], loaded[1]
+    assert loaded[0].frozen?
+    assert_equal "1.0.9a", loaded[0].to_s
+  end
+
+  def test_sorter_can_be_reused
+    sorter = VersionSorter::Sorter.new
+    versions = %w(1.0.9 1.0.10 2.0 3.1.4.2 1.0.9a)
+
+    assert_equal %w( 1.0.9 1.0.9a 1.0.10 2.0 3.1.4.2 ), sorter.sort(versions)
+    assert_equal %w( 0.5 1.0 ), sorter.sort(%w( 1.0 0.5 ))
+    assert_equal %w( 3.1.4.2 2.0 1.0.10 1.0.9a 1.0.9 ), sorter.rsort(versions)
+  end
+
+  def test_sorter_used_from_to_str
+    sorter = VersionSorter::Sorter.new
+    list = %w( 2.0 1.0.10 1.0.9 )
+    tricky = Object.new
+    tricky.define_singleton_method(:to_str) do
+      sorter.sort(%w( 3.0 1.0 ) * 100)
+      sorter.shrink
+      list.clear
+      GC.start
+      "1.0.9a"
+    end
+    list.insert(1, VersionSorter::Version.new("1.0.10a"), tricky)
+
+    sorted = sorter.sort(list)
+    assert_same tricky, sorted[1]
+    assert_equal %w( 1.0.9 1.0.10 1.0.10a 2.0 ), (sorted - [tricky]).map(&:to_s)
+  end
+
+  def test_sorter_shrink
+    sorter = VersionSorter::Sorter.new
+    sorter.sort(%w( 2.0 1.0 ))
+
+    assert_same sorter, sorter.shrink
+    assert_equal %w( 1.0 2.0 ), sorter.sort(%w( 2.0 1.0 ))
+  end
+
+  def test_sort_many
+    lists = [%w( 2.0 1.0.10 1.0.9 ), [], %w( yui3-999 yui3-990 3.1.4.2 )]
+    expected = [%w( 1.0.9 1.0.10 2.0 ), [], %w( 3.1.4.2 yui3-990 yui3-999 )]
+
+    assert_equal expected, sort_many(lists)
+    assert_equal expected, sort_many(lists, threads: 4)
+    assert_equal expected, VersionSorter::Sorter.new.sort_many(lists)
+    assert_equal lists[0][2].object_id, sort_many(lists)[0][0].object_id
+  end
+
+  def test_sort_many_thread_count
+    lists = Array.new(200) { %w( 2.0 1.0 ) }
+
+    assert_equal Array.new(200) { %w( 1.0 2.0 ) }, sort_many(lists, threads: 1000)
+    assert_raise(ArgumentError) { sort_many(lists, threads: 0) }
+    assert_raise(ArgumentError) { sort_many(lists, threads: -1) }
+  end
+
+  def test_sort_many_threads_match_one_thread
+    converted = Class.new { def initialize(v) @v = v end; def to_str() @v.dup end }
+    lists = Array.new(8) { |i| ["2.#{i}", "1.0.10", "1.0\0 9", "1.0\0 10", "1.0"].map { |v| converted.new(v) } }
+
+    GC.stress = true
+    begin
+      threaded = sort_many(lists, threads: 4)
+    ensure
+      GC.stress = false
+    end
+    assert_equal sort_many(lists).map { |list| list.map(&:to_str) }, threaded.map { |list| list.map(&:to_str) }
+    assert_equal ["1.0", "1.0\0 9", "1.0.10", "1.0\0 10", "2.0"], threaded[0].map(&:to_str)
+  end
+
+  def test_latest_per_line
+    versions = %w( 3.1.2 3.0.9 4.0.1 3.1.10 3.0.10 4.0.0 3 3.1.10-1 )
+
+    assert_equal %w( 3 3.0.10 3.1.10-1 4.0.1 ), latest_per_line(versions)
+    assert_equal %w( 3.1.10-1 4.0.1 ), latest_per_line(versions, depth: 1)
+    assert_equal %w( 4.0.1 ), latest_per_line(versions, depth: 0)
+    assert_equal [], latest_per_line([])
+    assert_equal versions[4].object_id, latest_per_line(versions)[1].object_id
+    assert_equal %w( 3 3.0.10 3.1.10-1 4.0.1 ), VersionSorter::Sorter.new.latest_per_line(versions)
+    assert_raise(ArgumentError) { latest_per_line(versions, depth: -1) }
+  end
+
+  def test_latest_per_line_matches_grouping_in_ruby
+    versions = IO.read(File.dirname(__FILE__) + '/tags.txt').split("\n")
+    lines = versions.group_by { |v| v.scan(/\d+|[a-zA-Z]+/).first(2) }
+
+    assert_equal sort(lines.values.map { |vs| vs.max_by { |v| sort_key(v) } }), latest_per_line(versions)
+  end
+
+  def test_sort_lines
+    buffer = "2.0\n1.0.10\n\n1.0.9a\n1.0.9\n"
+
+    assert_equal "1.0.9\n1.0.9a\n1.0.10\n2.0\n", sort_lines(buffer)
+    assert_equal "2.0\n1.0.10\n1.0.9a\n1.0.9\n", sort_lines(buffer, reverse: true)
+    assert_equal "1.0.9\n2.0", sort_lines("2.0\n1.0.9")
+    assert_equal "", sort_lines("")
+    assert_equal "2.0\n1.0.10\n1.0.9a\n1.0.9\n", VersionSorter::Sorter.new.sort_lines(buffer, reverse: true)
+  end
+
+  def test_sort_lines_with_a_block
+    buffer = "2.0\n1.0.10\n1.0.9\n".encode(Encoding::UTF_8)
+    lines = []
+
+    assert_nil sort_lines(buffer) { |line| lines << line }
+    assert_equal %w( 1.0.9 1.0.10 2.0 ), lines
+    assert_equal Encoding::UTF_8, lines.first.encoding
+    assert_equal %w( 2.0 1.0.10 1.0.9 ), enum_for(:sort_lines, buffer, reverse: true).to_a
+  end
+
+  def test_sort_lines_matches_sort
+    versions = IO.read(File.dirname(__FILE__) + '/tags.txt')
+
+    assert_equal sort(versions.split("\n")), sort_lines(versions).split("\n")
+    assert_equal rsort(versions.split("\n")), sort_lines(versions, reverse: true).split("\n")
+  end
+
+  def test_sort_key
+    key = sort_key("1.0.10a")
+
+    assert_equal Encoding::BINARY, key.encoding
+    assert_equal "\x01\x01\x011\x01\x010\x01\x0210\x02a\x00".b, key
+    assert_equal key, sort_key(VersionSorter::Version.new("1.0.10a"))
+    assert_equal sort_key("1-0-10-a"), key
+  end
+
+  def test_sort_keys_order_bytewise
+    versions = IO.read(File.dirname(__FILE__) + '/tags.txt').split("\n")
+
+    assert_equal sort(versions).map { |v| sort_key(v) }, versions.map { |v| sort_key(v) }.sort
+  end
+
+  def test_index
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "versions.idx")
+      VersionSorter::Index.build(path, %w( 1.0.10 2.0 1.0.9 1.0.9a 3.1.4.2 2.0 ))
+      index = VersionSorter::Index.new(path, verify: true)
+
+      assert_same index, index.verify
+      assert_equal %w( 1.0.9 1.0.9a 1.0.10 2.0 3.1.4.2 ), index.to_a
+      assert_equal "1.0.10", index[2]
+      assert_equal 2, index.rank("1.0.10")
+      assert index.include?("1.0.9a")
+      assert !index.include?("1.0.11")
+      assert_equal %w( 1.0.9a 1.0.10 2.0 ), index.range("1.0.9a", "2.0")
+      assert_equal %w( 3.1.4.2 2.0 ), index.latest(2)
+
+      VersionSorter::Index.append(path, %w( 1.0.11 2.0 é1.0 ))
+      assert_equal 5, index.size
+      reopened = VersionSorter::Index.new(path)
+      assert_equal %w( é1.0 1.0.9 1.0.9a 1.0.10 1.0.11 2.0 3.1.4.2 ), reopened.to_a
+      assert_equal Encoding::UTF_8, reopened[0].encoding
+      assert reopened.include?("é1.0")
+    end
+  end
+
+  def test_index_build_converts_entries_safely
+    converted = Class.new { def initialize(v) @v = v end; def to_str() @v.dup end }
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "versions.idx")
+      GC.stress = true
+      begin
+        VersionSorter::Index.build(path, Array.new(30) { |i| converted.new("1.#{i}") })
+      ensure
+        GC.stress = false
+      end
+
+      assert_equal Array.new(30) { |i| "1.#{i}" }, VersionSorter::Index.new(path, verify: true).to_a
+    end
+  end
+
+  def test_index_rejects_damaged_files
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "versions.idx")
+      VersionSorter::Index.build(path, %w( 1.0 2.0 ))
+      data = File.binread(path)
+      data[-2] = "1"
+      File.binwrite(path, data)
+
+      index = VersionSorter::Index.new(path)
+      assert_equal %w( 1.0 2.1 ), index.to_a
+      assert_raise(VersionSorter::Index::FormatError) { index.verify }
+      assert_raise(VersionSorter::Index::FormatError) { VersionSorter::Index.new(path, verify: true) }
+      assert_raise(VersionSorter::Index::FormatError) { VersionSorter::Index.append(path, %w( 3.0 )) }
+
+      data[0] = "X"
+      File.binwrite(path, data)
+      assert_raise(VersionSorter::Index::FormatError) { VersionSorter::Index.new(path) }
+    end
+  end
+
+  def test_concurrent_index_appends
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "versions.idx")
+      writers = 4
+
+      pids = writers.times.map do |w|
+        fork { 50.times { |i| VersionSorter::Index.append(path, ["#{w}.#{i}"]) } }
+      end if Process.respond_to?(:fork)
+      pids.each { |pid| assert Process.wait2(pid)[1].success? } if pids
+
+      if defined?(Ractor)
+        experimental, Warning[:experimental] = Warning[:experimental], false
+        ractors = writers.times.map do |w|
+          Ractor.new(path, w) do |path, w|
+            50.times { |i| VersionSorter::Index.append(path, ["#{w}.#{i}.r"]) }
+          end
+        end
+        ractors.each { |r| r.respond_to?(:value) ? r.value : r.take }
+        Warning[:experimental] = experimental
+      end
+
+      expected = (pids ? writers * 50 : 0) + (defined?(Ractor) ? writers * 50 : 0)
+      assert_equal expected, VersionSorter::Index.new(path).size
+      assert_equal [File.basename(path), File.basename(path) + ".lock"], Dir.children(dir).sort
+    end
+  end
+
+  def test_index_writer_waits_for_lock_without_gvl
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "versions.idx")
+      File.open(path + ".lock", File::RDWR | File::CREAT) do |lock|
+        lock.flock(File::LOCK_EX)
+        writer = Thread.new { VersionSorter::Index.append(path, %w( 1.0 )) }
+        sleep 0.05
+        assert_equal "sleep", writer.status
+        writer.kill
+        assert writer.join(1)
+
+        writer = Thread.new { VersionSorter::Index.append(path, %w( 2.0 )) }
+        sleep 0.05
+        lock.flock(File::LOCK_UN)
+        assert writer.join(5)
+      end
+
+      assert_equal %w( 2.0 ), VersionSorter::Index.new(path).to_a
+    end
+  end
+
+  def test_sorts_from_ractors
+    return unless defined?(Ractor)
+    experimental, Warning[:experimental] = Warning[:experimental], false
+
+    ractors = 4.times.map do |i|
+      Ractor.new(i) do |i|
+        versions = %w(1.0.9 1.0.10 2.0 3.1.4.2 1.0.9a).rotate(i)
+        [VersionSorter.sort(versions), VersionSorter::Sorter.new.rsort(versions)]
+      end
+    end
+
+    ractors.each do |r|
+      assert_equal [%w( 1.0.9 1.0.9a 1.0.10 2.0 3.1.4.2 ), %w( 3.1.4.2 2.0 1.0.10 1.0.9a 1.0.9 )],
+                   r.respond_to?(:value) ? r.value : r.take
+    end
+  ensure
+    Warning[:experimental] = experimental if defined?(Ractor)
+  end
+
+  def test_frozen_index_is_shareable
+    return unless defined?(Ractor)
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "versions.idx")
+      VersionSorter::Index.build(path, %w( 1.0 2.0 ))
+      index = VersionSorter::Index.new(path).freeze
+
+      assert Ractor.shareable?(index)
+      assert_raise(FrozenError) { index.close }
+    end
+  end
 end
-puts